@@ -0,0 +1,182 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "async.h"
+#include "workqueue.h"
+
+struct CryptPool
+{
+    struct WorkQueue *queue;
+
+    // Completed requests without callback, oldest first.
+    pthread_mutex_t lock;
+    struct CryptRequest *completedHead;
+    struct CryptRequest *completedTail;
+
+    // Readable whenever completed requests are waiting; an eventfd on Linux, a pipe elsewhere.
+    int readFd;
+    int writeFd;
+};
+
+static void signalCompletion(struct CryptPool *pool)
+{
+#ifdef __linux__
+    uint64_t value = 1;
+#else
+    uint8_t value = 1;
+#endif
+    while (write(pool->writeFd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
+
+static void drainCompletionFd(struct CryptPool *pool)
+{
+    uint8_t buffer[64];
+    while (read(pool->readFd, buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+static void runCryptRequest(void *argument)
+{
+    struct CryptRequest *request = (struct CryptRequest *)argument;
+    struct CryptPool *pool = request->pool;
+
+    if (request->operation == CRYPT_DECRYPT)
+        request->result = decryptImage(request->output, request->input, request->size, request->masterKey);
+    else
+        request->result = encryptImage(request->output, request->input, request->size, request->masterKey);
+
+    if (request->callback) {
+        request->callback(request);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    request->next = NULL;
+    if (pool->completedTail)
+        pool->completedTail->next = request;
+    else
+        pool->completedHead = request;
+    pool->completedTail = request;
+    pthread_mutex_unlock(&pool->lock);
+
+    signalCompletion(pool);
+}
+
+struct CryptPool CRYPTER_EXPORT *createCryptPool(int threadCount, int queueDepth)
+{
+    struct CryptPool *pool = (struct CryptPool *)calloc(1, sizeof(struct CryptPool));
+    if (!pool)
+        return NULL;
+
+#ifdef __linux__
+    pool->readFd = pool->writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->readFd < 0) {
+        free(pool);
+        return NULL;
+    }
+#else
+    int fds[2];
+    if (pipe(fds)) {
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    pool->readFd  = fds[0];
+    pool->writeFd = fds[1];
+#endif
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->queue = createWorkQueue(threadCount, queueDepth);
+    if (!pool->queue) {
+        destroyCryptPool(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+// Finish all submitted requests, then stop the workers and free the pool.
+void CRYPTER_EXPORT destroyCryptPool(struct CryptPool *pool)
+{
+    if (pool->queue)
+        destroyWorkQueue(pool->queue);
+
+    pthread_mutex_destroy(&pool->lock);
+    if (pool->writeFd != pool->readFd)
+        close(pool->writeFd);
+    close(pool->readFd);
+    free(pool);
+}
+
+// Queue request to be run on the pool. Never blocks.
+// Returns CRYPT_ERROR_QUEUE_FULL if the pool cannot take more requests right now.
+int CRYPTER_EXPORT submitCryptRequest(struct CryptPool *pool, struct CryptRequest *request)
+{
+    request->pool = pool;
+    if (trySubmitWork(pool->queue, runCryptRequest, request))
+        return CRYPT_ERROR_QUEUE_FULL;
+
+    return CRYPT_OK;
+}
+
+// File descriptor that becomes readable when completed requests are waiting for pollCryptCompletion.
+int CRYPTER_EXPORT getCryptCompletionFd(struct CryptPool *pool)
+{
+    return pool->readFd;
+}
+
+// Take the oldest completed request without callback, or NULL if there is none.
+struct CryptRequest CRYPTER_EXPORT *pollCryptCompletion(struct CryptPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    struct CryptRequest *request = pool->completedHead;
+    if (request) {
+        pool->completedHead = request->next;
+        if (!pool->completedHead)
+            pool->completedTail = NULL;
+    }
+    else {
+        // Only reset the descriptor while holding the lock, so no signal for a new request is lost.
+        drainCompletionFd(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return request;
+}
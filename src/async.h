@@ -0,0 +1,79 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#ifndef _ASYNC_H
+#define _ASYNC_H
+
+#include <stdint.h>
+
+#include "crypt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CRYPT_DECRYPT 0
+#define CRYPT_ENCRYPT 1
+
+// Fixed pool of worker threads running crypt requests.
+struct CryptPool;
+
+// Asynchronous counterpart of decryptImage/encryptImage.
+// The request must stay alive and untouched until it has completed.
+struct CryptRequest
+{
+    int operation;                          // CRYPT_DECRYPT or CRYPT_ENCRYPT.
+    const uint8_t *input;
+    uint8_t *output;                        // May be the same as input.
+    uint32_t size;
+    const struct MasterKeyInfo *masterKey;
+
+    // Called on a worker thread once the request is done. Without a callback, the request is
+    // queued for pollCryptCompletion instead and the completion file descriptor is signalled.
+    void (*callback)(struct CryptRequest *request);
+    void *userData;
+
+    int result;                             // Result of decryptImage/encryptImage once completed.
+
+    // Used internally.
+    struct CryptPool *pool;
+    struct CryptRequest *next;
+};
+
+struct CryptPool CRYPTER_EXPORT *createCryptPool(int threadCount, int queueDepth);
+void CRYPTER_EXPORT destroyCryptPool(struct CryptPool *pool);
+
+int CRYPTER_EXPORT submitCryptRequest(struct CryptPool *pool, struct CryptRequest *request);
+
+int CRYPTER_EXPORT getCryptCompletionFd(struct CryptPool *pool);
+struct CryptRequest CRYPTER_EXPORT *pollCryptCompletion(struct CryptPool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ASYNC_H */
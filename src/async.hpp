@@ -0,0 +1,168 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#ifndef _ASYNC_HPP
+#define _ASYNC_HPP
+
+// C++20 coroutine support for the asynchronous API.
+// Awaiting a request suspends the coroutine until a pool worker has finished it. By default, the
+// coroutine is then resumed on that worker thread, so until it suspends again, it occupies the worker
+// and must not destroy the pool, which would wait for the worker to finish and therefore deadlock.
+// With ResumeOn::Caller, the coroutine is instead resumed by resumeCompleted, which the event loop of
+// the awaiting thread calls once getCryptCompletionFd becomes readable.
+
+#include <coroutine>
+#include <cstdint>
+#include <span>
+#include <utility>
+
+#include "async.h"
+#include "crypt.hpp"
+
+namespace pesx {
+
+// Move-only owner of a CryptPool.
+class CryptPoolHandle
+{
+public:
+    CryptPoolHandle(int threadCount, int queueDepth) : pool_(createCryptPool(threadCount, queueDepth)) {}
+    CryptPoolHandle(CryptPoolHandle &&other) noexcept : pool_(other.pool_) { other.pool_ = nullptr; }
+    CryptPoolHandle &operator=(CryptPoolHandle &&other) noexcept
+    {
+        std::swap(pool_, other.pool_);
+        return *this;
+    }
+    CryptPoolHandle(const CryptPoolHandle &) = delete;
+    CryptPoolHandle &operator=(const CryptPoolHandle &) = delete;
+    ~CryptPoolHandle()
+    {
+        if (pool_)
+            destroyCryptPool(pool_);
+    }
+
+    explicit operator bool() const { return pool_ != nullptr; }
+    CryptPool *get() const { return pool_; }
+
+private:
+    CryptPool *pool_;
+};
+
+// Thread on which a coroutine awaiting a request is resumed.
+enum class ResumeOn
+{
+    Worker, // The pool worker that finished the request.
+    Caller, // The thread calling resumeCompleted on the pool.
+};
+
+// Awaitable running decryptImage or encryptImage on a pool; yields the resulting Error.
+class CryptAwaitable
+{
+public:
+    CryptAwaitable(CryptPool *pool, int operation, std::span<const std::uint8_t> input, std::span<std::uint8_t> output,
+                   const MasterKeyInfo &masterKey, ResumeOn resumeOn = ResumeOn::Worker)
+        : pool_(pool), request_()
+    {
+        request_.operation = operation;
+        request_.input     = input.data();
+        request_.output    = output.data();
+        request_.size      = static_cast<std::uint32_t>(input.size());
+        request_.masterKey = &masterKey;
+        request_.callback  = resumeOn == ResumeOn::Worker ? &CryptAwaitable::complete : nullptr;
+        request_.userData  = this;
+        request_.result    = (output.size() != input.size() || input.size() > UINT32_MAX) ? CRYPT_ERROR_INVALID_SIZE : CRYPT_OK;
+    }
+
+    CryptAwaitable(const CryptAwaitable &) = delete;
+    CryptAwaitable &operator=(const CryptAwaitable &) = delete;
+
+    bool await_ready() const noexcept { return request_.result != CRYPT_OK; }
+
+    // Do not suspend if the request could not be submitted, so the error is returned right away.
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        // Once submitted, the request may complete and resume the coroutine at any time, so it must not be touched anymore.
+        handle_ = handle;
+        int result = submitCryptRequest(pool_, &request_);
+        if (result == CRYPT_OK)
+            return true;
+        request_.result = result;
+        return false;
+    }
+
+    Error await_resume() const noexcept { return static_cast<Error>(request_.result); }
+
+private:
+    friend int resumeCompleted(const CryptPoolHandle &pool);
+
+    static void complete(CryptRequest *request)
+    {
+        static_cast<CryptAwaitable *>(request->userData)->handle_.resume();
+    }
+
+    CryptPool *pool_;
+    CryptRequest request_;
+    std::coroutine_handle<> handle_;
+};
+
+inline CryptAwaitable decryptAsync(const CryptPoolHandle &pool, std::span<const std::uint8_t> input, std::span<std::uint8_t> output,
+                                   const MasterKeyInfo &masterKey, ResumeOn resumeOn = ResumeOn::Worker)
+{
+    return { pool.get(), CRYPT_DECRYPT, input, output, masterKey, resumeOn };
+}
+
+inline CryptAwaitable encryptAsync(const CryptPoolHandle &pool, std::span<const std::uint8_t> input, std::span<std::uint8_t> output,
+                                   const MasterKeyInfo &masterKey, ResumeOn resumeOn = ResumeOn::Worker)
+{
+    return { pool.get(), CRYPT_ENCRYPT, input, output, masterKey, resumeOn };
+}
+
+// Resume all coroutines whose ResumeOn::Caller requests have completed, on the calling thread; returns their number.
+// The completed requests are taken from the pool before any coroutine is resumed, so the resumed coroutines may destroy
+// the pool. The pool must not be used for requests without callback from C at the same time.
+inline int resumeCompleted(const CryptPoolHandle &pool)
+{
+    CryptRequest *completed = nullptr;
+    CryptRequest **tail = &completed;
+    while (CryptRequest *request = pollCryptCompletion(pool.get())) {
+        *tail = request;
+        tail = &request->next;
+    }
+    *tail = nullptr;
+
+    int count = 0;
+    for (CryptRequest *request = completed; request; ++count) {
+        // The request lives in the awaitable, which is gone once its coroutine has been resumed.
+        CryptRequest *next = request->next;
+        CryptAwaitable::complete(request);
+        request = next;
+    }
+    return count;
+}
+
+} // namespace pesx
+
+#endif /* _ASYNC_HPP */
@@ -0,0 +1,620 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "masterkey.h"
+#include "crypt.h"
+
+// Processes the files listed in a manifest, optionally split into shards that can run on several
+// machines sharing a directory, without any coordination between them.
+//
+// Every line of the manifest is a task of tab-separated fields, like the daemon requests:
+//   decrypt <input_file> <output_dir> [master_key_name]
+//   encrypt <input_dir> <output_file> [master_key_name]
+// Every shard appends the outcome of its tasks to its own journal within the journal directory, so a
+// restarted shard skips tasks it already finished. The merge command sums up all journals.
+//
+// Partitioning by size depends on the sizes of the inputs, which may look different from every machine
+// and change between restarts. Therefore, the first shard to start stores the partition in the journal
+// directory, and all shards, including restarted ones, use the stored partition.
+
+#define SHARD_BY_HASH 0
+#define SHARD_BY_SIZE 1
+
+struct Task
+{
+    int index;              // Position of the task within the manifest and its tasks array, counting from 0.
+    char *operation;
+    char *input;
+    char *output;
+    char *keyName;
+    uint64_t size;
+    int shard;
+    int done;
+};
+
+struct Manifest
+{
+    struct Task *tasks;
+    int count;
+};
+
+
+// 64 bit FNV-1a, which does not depend on the machine.
+static uint64_t hashString(const char *string)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (; *string; ++string) {
+        hash ^= (uint8_t)*string;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static char *duplicate(const char *string)
+{
+    char *result = (char *)malloc(strlen(string) + 1);
+    if (result)
+        strcpy(result, string);
+    return result;
+}
+
+// Size of the input of a task; for encryption, this is the sum of all files in the input directory.
+static uint64_t getInputSize(const char *path)
+{
+    struct stat file;
+    if (stat(path, &file))
+        return 0;
+    if (!S_ISDIR(file.st_mode))
+        return file.st_size;
+
+    uint64_t size = 0;
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        char *child = (char *)malloc(strlen(path) + strlen(entry->d_name) + 2);
+        sprintf(child, "%s/%s", path, entry->d_name);
+        if (!stat(child, &file) && S_ISREG(file.st_mode))
+            size += file.st_size;
+        free(child);
+    }
+    if (dir)
+        closedir(dir);
+    return size;
+}
+
+static int loadManifest(const char *path, struct Manifest *manifest)
+{
+    FILE *stream = fopen(path, "r");
+    if (!stream)
+        return -1;
+
+    char *line = NULL;
+    size_t capacity = 0, taskCapacity = 0;
+    ssize_t length;
+    int index = 0;
+    while ((length = getline(&line, &capacity, stream)) > 0) {
+        while (length && (line[length-1] == '\n' || line[length-1] == '\r'))
+            line[--length] = '\0';
+        if (!length || line[0] == '#')
+            continue;
+
+        if ((size_t)manifest->count == taskCapacity) {
+            taskCapacity = taskCapacity ? taskCapacity * 2 : 256;
+            struct Task *tasks = (struct Task *)realloc(manifest->tasks, taskCapacity * sizeof(struct Task));
+            if (!tasks) {
+                free(line);
+                fclose(stream);
+                return -1;
+            }
+            manifest->tasks = tasks;
+        }
+
+        struct Task *task = &manifest->tasks[manifest->count];
+        memset(task, 0, sizeof(struct Task));
+        char *fields[4] = { NULL, NULL, NULL, NULL };
+        char *cursor = line;
+        for (int i = 0; i < 4 && cursor; ++i) {
+            fields[i] = cursor;
+            cursor = strchr(cursor, '\t');
+            if (cursor)
+                *cursor++ = '\0';
+        }
+        if (!fields[2] || (strcmp(fields[0], "decrypt") && strcmp(fields[0], "encrypt"))) {
+            printf("Invalid manifest line: %s\n", line);
+            continue;
+        }
+
+        task->index     = index++;
+        task->operation = duplicate(fields[0]);
+        task->input     = duplicate(fields[1]);
+        task->output    = duplicate(fields[2]);
+        task->keyName   = fields[3] ? duplicate(fields[3]) : NULL;
+        ++manifest->count;
+    }
+
+    free(line);
+    fclose(stream);
+    return 0;
+}
+
+static void freeManifest(struct Manifest *manifest)
+{
+    for (int i = 0; i < manifest->count; ++i) {
+        free(manifest->tasks[i].operation);
+        free(manifest->tasks[i].input);
+        free(manifest->tasks[i].output);
+        free(manifest->tasks[i].keyName);
+    }
+    free(manifest->tasks);
+}
+
+// Biggest tasks first, ties broken by manifest order, so every machine sorts the same way.
+static int compareTaskSizes(const void *a, const void *b)
+{
+    const struct Task *taskA = *(const struct Task **)a, *taskB = *(const struct Task **)b;
+    if (taskA->size != taskB->size)
+        return taskA->size < taskB->size ? 1 : -1;
+    return taskA->index - taskB->index;
+}
+
+// Assign every task to the shard with the smallest cumulative input size so far, biggest tasks first.
+static void partitionBySize(struct Manifest *manifest, int shardCount)
+{
+    struct Task **order = (struct Task **)malloc(manifest->count * sizeof(struct Task *));
+    uint64_t *load = (uint64_t *)calloc(shardCount, sizeof(uint64_t));
+    for (int i = 0; i < manifest->count; ++i) {
+        manifest->tasks[i].size = getInputSize(manifest->tasks[i].input);
+        order[i] = &manifest->tasks[i];
+    }
+    qsort(order, manifest->count, sizeof(struct Task *), compareTaskSizes);
+
+    for (int i = 0; i < manifest->count; ++i) {
+        int lightest = 0;
+        for (int shard = 1; shard < shardCount; ++shard)
+            if (load[shard] < load[lightest])
+                lightest = shard;
+        order[i]->shard = lightest;
+        load[lightest] += order[i]->size;
+    }
+
+    free(load);
+    free(order);
+}
+
+// Partition lines are: task index, shard, input.
+// Returns 0 if the partition at path was read and matches the manifest, 1 if there is none, or -1 if it does not match.
+static int readPartition(const char *path, struct Manifest *manifest, int shardCount)
+{
+    FILE *stream = fopen(path, "r");
+    if (!stream)
+        return errno == ENOENT ? 1 : -1;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int assigned = 0, result = 0;
+    while (!result && (length = getline(&line, &capacity, stream)) > 0) {
+        if (line[length-1] == '\n')
+            line[--length] = '\0';
+        char *cursor;
+        long index = strtol(line, &cursor, 10);
+        long shard = *cursor == '\t' ? strtol(cursor + 1, &cursor, 10) : -1;
+        if (*cursor != '\t' || index < 0 || index >= manifest->count || shard < 0 || shard >= shardCount
+            || strcmp(manifest->tasks[index].input, cursor + 1)) {
+            result = -1;
+            break;
+        }
+        manifest->tasks[index].shard = (int)shard;
+        ++assigned;
+    }
+
+    free(line);
+    fclose(stream);
+    return (result || assigned != manifest->count) ? -1 : 0;
+}
+
+// Store the partition at path, unless another shard was faster.
+// Returns 0 if it was stored, 1 if there already is one, or -1 on failure.
+static int writePartition(const char *path, const struct Manifest *manifest)
+{
+    char *tempPath = (char *)malloc(strlen(path) + 8);
+    sprintf(tempPath, "%s.XXXXXX", path);
+    int fd = mkstemp(tempPath);
+    FILE *stream = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!stream) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tempPath);
+        }
+        free(tempPath);
+        return -1;
+    }
+
+    for (int i = 0; i < manifest->count; ++i)
+        fprintf(stream, "%d\t%d\t%s\n", manifest->tasks[i].index, manifest->tasks[i].shard, manifest->tasks[i].input);
+    int result = (fflush(stream) || fsync(fd)) ? -1 : 0;
+    if (fclose(stream))
+        result = -1;
+
+    // Unlike rename, link never replaces a partition another shard stored in the meantime.
+    if (!result && link(tempPath, path))
+        result = errno == EEXIST ? 1 : -1;
+    unlink(tempPath);
+    free(tempPath);
+    return result;
+}
+
+// Assign every task to a shard. Hashing the input path keeps the assignment stable when tasks are added;
+// balancing cumulative input size gives every shard about the same amount of work.
+static int assignShards(struct Manifest *manifest, const char *journalDir, int shardCount, int mode)
+{
+    if (mode == SHARD_BY_HASH) {
+        for (int i = 0; i < manifest->count; ++i)
+            manifest->tasks[i].shard = hashString(manifest->tasks[i].input) % shardCount;
+        return 0;
+    }
+
+    char *path = (char *)malloc(strlen(journalDir) + 64);
+    sprintf(path, "%s/partition-of-%d.tsv", journalDir, shardCount);
+
+    int result = readPartition(path, manifest, shardCount);
+    if (result > 0) {
+        partitionBySize(manifest, shardCount);
+        result = writePartition(path, manifest);
+        if (result > 0)
+            result = readPartition(path, manifest, shardCount);
+    }
+    if (result)
+        printf("The partition %s does not match the manifest; remove it to partition again\n", path);
+
+    free(path);
+    return result;
+}
+
+static char *getJournalPath(const char *journalDir, int shard, int shardCount)
+{
+    char *path = (char *)malloc(strlen(journalDir) + 64);
+    sprintf(path, "%s/shard-%d-of-%d.journal", journalDir, shard, shardCount);
+    return path;
+}
+
+// Journal lines are: status, task index, input, input size, seconds taken, file type.
+// Mark all tasks the journal records as done, as long as the manifest still has the same input at that line.
+static void readJournal(const char *path, struct Manifest *manifest)
+{
+    FILE *stream = fopen(path, "r");
+    if (!stream)
+        return;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, stream) > 0) {
+        char *status = strtok(line, "\t");
+        char *index  = strtok(NULL, "\t");
+        char *input  = strtok(NULL, "\t");
+        if (!status || !index || !input || strcmp(status, "done"))
+            continue;
+
+        int i = atoi(index);
+        if (i >= 0 && i < manifest->count && !strcmp(manifest->tasks[i].input, input))
+            manifest->tasks[i].done = 1;
+    }
+
+    free(line);
+    fclose(stream);
+}
+
+// Run task and find out the type of file it processed from the decrypted file header.
+static int runTask(const struct Task *task, const struct MasterKeyInfo *masterKey, char *fileType)
+{
+    int decrypt = !strcmp(task->operation, "decrypt");
+    int result = decrypt ? decryptWithKeyInfo_ex(task->input, task->output, masterKey)
+                         : encryptWithKeyInfo_ex(task->input, task->output, masterKey);
+
+    uint32_t size;
+    uint8_t *data = result ? NULL : readFileDir(decrypt ? task->output : task->input, "header.dat", &size);
+    strcpy(fileType, "-");
+    if (data && size >= masterKey->fileHeaderSize) {
+        struct FileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(&header, data, masterKey->fileHeaderSize);
+        copyFileType(fileType, &header);
+    }
+    free(data);
+
+    return result;
+}
+
+static int runShard(const char *manifestPath, const char *journalDir, int shard, int shardCount, int mode,
+                    const struct MasterKeyInfo *defaultMasterKey)
+{
+    struct Manifest manifest = { NULL, 0 };
+    if (loadManifest(manifestPath, &manifest)) {
+        printf("Unable to read manifest %s\n", manifestPath);
+        return -1;
+    }
+    mkdir(journalDir, 0777);
+    if (assignShards(&manifest, journalDir, shardCount, mode)) {
+        freeManifest(&manifest);
+        return -1;
+    }
+
+    char *journalPath = getJournalPath(journalDir, shard, shardCount);
+    readJournal(journalPath, &manifest);
+    FILE *journal = fopen(journalPath, "a");
+    free(journalPath);
+    if (!journal) {
+        printf("Unable to open journal in %s\n", journalDir);
+        freeManifest(&manifest);
+        return -1;
+    }
+
+    int processed = 0, skipped = 0, failed = 0;
+    for (int i = 0; i < manifest.count; ++i) {
+        const struct Task *task = &manifest.tasks[i];
+        if (task->shard != shard)
+            continue;
+        if (task->done) {
+            ++skipped;
+            continue;
+        }
+
+        const struct MasterKeyInfo *masterKey = task->keyName ? findMasterKey(task->keyName) : defaultMasterKey;
+        char fileType[sizeof(((struct FileHeader *)0)->fileTypeString) + 1];
+        double start = now();
+        int result = masterKey ? runTask(task, masterKey, fileType) : -1;
+        if (!masterKey)
+            strcpy(fileType, "-");
+
+        // Flush every entry, so a killed shard loses at most the task it was working on.
+        fprintf(journal, "%s\t%d\t%s\t%llu\t%.6f\t%s\n", result ? "fail" : "done", task->index, task->input,
+                (unsigned long long)getInputSize(task->input), now() - start, fileType);
+        fflush(journal);
+
+        ++processed;
+        if (result) {
+            printf("Unable to %s %s\n", task->operation, task->input);
+            ++failed;
+        }
+    }
+    fclose(journal);
+
+    printf("Shard %d/%d: processed %d, skipped %d already done, failed %d\n", shard, shardCount, processed, skipped, failed);
+    freeManifest(&manifest);
+
+    return failed ? -1 : 0;
+}
+
+struct TypeStats
+{
+    char fileType[40];
+    int count;
+    uint64_t bytes;
+};
+
+struct Record
+{
+    int used;
+    int done;
+    uint64_t bytes;
+    double seconds;
+    char fileType[40];
+    char *input;
+};
+
+// Combine all journals in journalDir: print totals and a per file type inventory, and write the
+// state of every task to inventory.tsv. A task counts as done once any journal records it as done.
+static int mergeJournals(const char *journalDir)
+{
+    DIR *dir = opendir(journalDir);
+    if (!dir) {
+        printf("Unable to open %s\n", journalDir);
+        return -1;
+    }
+
+    // Records are addressed by task index.
+    struct Record *records = NULL;
+    int recordCount = 0, recordCapacity = 0, journalCount = 0;
+    struct dirent *file;
+    char *line = NULL;
+    size_t capacity = 0;
+    while ((file = readdir(dir))) {
+        size_t length = strlen(file->d_name);
+        if (length < 8 || strcmp(&file->d_name[length - 8], ".journal"))
+            continue;
+
+        char *path = (char *)malloc(strlen(journalDir) + length + 2);
+        sprintf(path, "%s/%s", journalDir, file->d_name);
+        FILE *stream = fopen(path, "r");
+        free(path);
+        if (!stream)
+            continue;
+        ++journalCount;
+
+        while (getline(&line, &capacity, stream) > 0) {
+            char *status  = strtok(line, "\t");
+            char *index   = strtok(NULL, "\t");
+            char *input   = strtok(NULL, "\t");
+            char *bytes   = strtok(NULL, "\t");
+            char *seconds = strtok(NULL, "\t");
+            char *type    = strtok(NULL, "\t\n");
+            if (!type)
+                continue;
+
+            char *end;
+            long i = strtol(index, &end, 10);
+            if (*end || i < 0 || i >= INT_MAX / 2)
+                continue;
+            if (i >= recordCapacity) {
+                int grownCapacity = recordCapacity ? recordCapacity : 256;
+                while (grownCapacity <= i)
+                    grownCapacity *= 2;
+                struct Record *grown = (struct Record *)realloc(records, grownCapacity * sizeof(struct Record));
+                if (!grown)
+                    break;
+                memset(&grown[recordCapacity], 0, (grownCapacity - recordCapacity) * sizeof(struct Record));
+                records = grown;
+                recordCapacity = grownCapacity;
+            }
+
+            struct Record *record = &records[i];
+            if (record->done)
+                continue;
+            if (!record->used) {
+                record->used = 1;
+                ++recordCount;
+            }
+
+            free(record->input);
+            record->done    = !strcmp(status, "done");
+            record->bytes   = strtoull(bytes, NULL, 10);
+            record->seconds = atof(seconds);
+            record->input   = duplicate(input);
+            snprintf(record->fileType, sizeof(record->fileType), "%s", type);
+        }
+        fclose(stream);
+    }
+    free(line);
+    closedir(dir);
+
+    char *inventoryPath = (char *)malloc(strlen(journalDir) + 16);
+    sprintf(inventoryPath, "%s/inventory.tsv", journalDir);
+    FILE *inventory = fopen(inventoryPath, "w");
+    free(inventoryPath);
+
+    struct TypeStats *types = (struct TypeStats *)calloc(recordCount + 1, sizeof(struct TypeStats));
+    int typeCount = 0, done = 0;
+    uint64_t totalBytes = 0;
+    double totalSeconds = 0;
+    for (int i = 0; i < recordCapacity; ++i) {
+        const struct Record *record = &records[i];
+        if (!record->used)
+            continue;
+        if (inventory)
+            fprintf(inventory, "%d\t%s\t%s\t%llu\t%s\n", i, record->done ? "done" : "fail",
+                    record->fileType, (unsigned long long)record->bytes, record->input);
+        if (!record->done)
+            continue;
+
+        ++done;
+        totalBytes   += record->bytes;
+        totalSeconds += record->seconds;
+
+        int type = 0;
+        while (type < typeCount && strcmp(types[type].fileType, record->fileType))
+            ++type;
+        if (type == typeCount)
+            strcpy(types[typeCount++].fileType, record->fileType);
+        ++types[type].count;
+        types[type].bytes += record->bytes;
+    }
+    if (inventory)
+        fclose(inventory);
+
+    printf("Journals: %d\nTasks: %d done, %d failed\nBytes: %llu\nProcessing time: %.3f s\n",
+           journalCount, done, recordCount - done, (unsigned long long)totalBytes, totalSeconds);
+    for (int i = 0; i < typeCount; ++i)
+        printf("%s\t%d\t%llu\n", types[i].fileType, types[i].count, (unsigned long long)types[i].bytes);
+
+    for (int i = 0; i < recordCapacity; ++i)
+        free(records[i].input);
+    free(records);
+    free(types);
+
+    return recordCount == done ? 0 : -1;
+}
+
+static void printUsage()
+{
+    printf("Usage: pesXbatch run [--shard i/n] [--by-size] [manifest] [journal_dir] [[master_key_file|master_key_name] [game_version]]\n"
+           "       pesXbatch merge [journal_dir]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "merge"))
+        return mergeJournals(argv[2]);
+    if (argc < 2 || strcmp(argv[1], "run")) {
+        printUsage();
+        return -1;
+    }
+
+    int shard = 0, shardCount = 1, mode = SHARD_BY_HASH, next = 2;
+    for (; next < argc && !strncmp(argv[next], "--", 2); ++next) {
+        if (!strcmp(argv[next], "--shard") && next + 1 < argc) {
+            if (sscanf(argv[++next], "%d/%d", &shard, &shardCount) != 2 || shardCount < 1 || shard < 0 || shard >= shardCount) {
+                printUsage();
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[next], "--by-size")) {
+            mode = SHARD_BY_SIZE;
+        }
+        else {
+            printUsage();
+            return -1;
+        }
+    }
+
+    int rest = argc - next;
+    if (rest < 2 || rest > 4) {
+        printUsage();
+        return -1;
+    }
+
+    // Without a default key, every task of the manifest has to name its key.
+    const struct MasterKeyInfo *masterKey = NULL;
+    if (rest >= 3) {
+        masterKey = findOrLoadMasterKey(argv[next + 2], rest == 4 ? atoi(argv[next + 3]) : 0);
+        if (!masterKey) {
+            printf("Invalid master key!\n");
+            return -1;
+        }
+    }
+
+    return runShard(argv[next], argv[next + 1], shard, shardCount, mode, masterKey);
+}
@@ -25,16 +25,39 @@
     For more information, please refer to <http://unlicense.org>
  */
 
+// For fsync, fchmod, posix_fallocate and mmap, which replace files through a temporary file.
+#ifdef __unix__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/stat.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef __unix__
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include "mt19937ar.h"
 #include "crypt.h"
 #include "masterkey.h"
+#include "trace.h"
 
-#define ENCRYPTION_HEADER_SIZE 320
+// The _ex functions report errors to the user of the command line tools. The library and the daemon,
+// which answers its clients instead, define BUILDING_LIBRARY or CRYPT_QUIET to stay silent.
+#if !defined(BUILDING_LIBRARY) && !defined(CRYPT_QUIET)
+#define PRINT_MESSAGES
+#endif
 
 
 uint32_t rol(uint32_t a, uint32_t shift)
@@ -55,11 +78,13 @@ void xorRepeatingBlocks(uint8_t *output, const uint8_t *input, int length)
 
 void xorWithLongParam(const uint8_t *input, uint8_t *output, uint64_t param)
 {
-    const uint64_t * input64 = (uint64_t *)input;
-          uint64_t *output64 = (uint64_t *)output;
-
-    for (int i = 0; i < 8; ++i)
-        output64[i] = input64[i] ^ param;
+    // Keys are byte arrays without any alignment, so the words are copied in and out.
+    for (int i = 0; i < 8; ++i) {
+        uint64_t word;
+        memcpy(&word, &input[i*8], 8);
+        word ^= param;
+        memcpy(&output[i*8], &word, 8);
+    }
 }
 
 void reverseLongs(uint8_t *output, const uint8_t *input)
@@ -71,19 +96,28 @@ void reverseLongs(uint8_t *output, const uint8_t *input)
 
 void cryptStream(uint8_t *output, const uint8_t *key, const uint8_t *input, int length)
 {
-    uint32_t *input32 = (uint32_t *)input;
-    uint32_t *output32 = (uint32_t *)output;
-
-    init_by_array((uint32_t *)key, 16);
-    uint32_t c0 = genrand_int32();
-    uint32_t c1 = genrand_int32();
-    uint32_t c2 = genrand_int32();
-    uint32_t c3 = genrand_int32();
-
+    // Every stream gets its own generator, so that files can be processed concurrently.
+    TRACE_BEGIN(seed);
+    struct mt19937ar mt;
+    uint32_t keyWords[16];
+    memcpy(keyWords, key, 64);
+    init_by_array_r(&mt, keyWords, 16);
+    uint32_t c0 = genrand_int32_r(&mt);
+    uint32_t c1 = genrand_int32_r(&mt);
+    uint32_t c2 = genrand_int32_r(&mt);
+    uint32_t c3 = genrand_int32_r(&mt);
+    TRACE_END(seed, "seed", NULL, 0);
+
+    // Generating the keystream and XORing it are fused into a single pass here.
+    // Blocks start at any offset within a file, so the words are loaded and stored with memcpy.
+    TRACE_BEGIN(keystream);
     for (int i = 0; i < length/4; ++i) {
-        uint32_t c4 = genrand_int32();
+        uint32_t c4 = genrand_int32_r(&mt);
 
-        output32[i] = c4 ^ c3 ^ c2 ^ c1 ^ c0 ^ input32[i];
+        uint32_t word;
+        memcpy(&word, &input[i*4], 4);
+        word ^= c4 ^ c3 ^ c2 ^ c1 ^ c0;
+        memcpy(&output[i*4], &word, 4);
 
         c0 = ror(c1, 15);
         c1 = rol(c2, 11);
@@ -94,38 +128,272 @@ void cryptStream(uint8_t *output, const uint8_t *key, const uint8_t *input, int
         uint32_t rest;
         memcpy(&rest, &input[length & (~3)], length & 3);
 
-        rest ^= genrand_int32() ^ c3 ^ c2 ^ c1 ^ c0;
+        rest ^= genrand_int32_r(&mt) ^ c3 ^ c2 ^ c1 ^ c0;
 
         memcpy(&output[length & (~3)], &rest, length & 3);
     }
+    TRACE_END(keystream, "keystream", NULL, length);
 }
 
-void cryptHeader(uint8_t *output, const uint8_t *input, const uint8_t *key)
+// Round a stream length up to whole keystream words.
+#define KEYSTREAM_SIZE(length) (((size_t)(length) + 3) & ~(size_t)3)
+
+// Generate the keystream cryptStream would XOR with a stream of the given length.
+// The keystream is KEYSTREAM_SIZE(length) bytes long.
+static void generateKeystream(uint8_t *keystream, const uint8_t *key, uint32_t length)
 {
-    uint8_t headerKey[64], shuffledMasterKey[64];
+    TRACE_BEGIN(seed);
+    struct mt19937ar mt;
+    uint32_t keyWords[16];
+    memcpy(keyWords, key, 64);
+    init_by_array_r(&mt, keyWords, 16);
+    uint32_t c0 = genrand_int32_r(&mt);
+    uint32_t c1 = genrand_int32_r(&mt);
+    uint32_t c2 = genrand_int32_r(&mt);
+    uint32_t c3 = genrand_int32_r(&mt);
+    TRACE_END(seed, "seed", NULL, 0);
+
+    TRACE_BEGIN(generate);
+    uint32_t words = (uint32_t)(KEYSTREAM_SIZE(length) / 4);
+    for (uint32_t i = 0; i < words; ++i) {
+        uint32_t c4 = genrand_int32_r(&mt);
+        uint32_t word = c4 ^ c3 ^ c2 ^ c1 ^ c0;
+        memcpy(&keystream[i*4], &word, 4);
 
-    memcpy(headerKey, &input[256], 64);
-    reverseLongs(shuffledMasterKey, key);
+        c0 = ror(c1, 15);
+        c1 = rol(c2, 11);
+        c2 = rol(c3, 7);
+        c3 = ror(c4, 13);
+    }
+    TRACE_END(generate, "generate", NULL, length);
+}
+
+// XOR length bytes of input with a keystream. Works on 64 bit words, which compilers turn into vector code.
+static void xorKeystream(uint8_t *output, const uint8_t *input, const uint8_t *keystream, uint32_t length)
+{
+    TRACE_BEGIN(apply);
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, &input[i], 8);
+        memcpy(&b, &keystream[i], 8);
+        a ^= b;
+        memcpy(&output[i], &a, 8);
+    }
+    for (; i < length; ++i)
+        output[i] = input[i] ^ keystream[i];
+    TRACE_END(apply, "xor", NULL, length);
+}
+
+struct KeystreamCacheEntry
+{
+    struct KeystreamCacheEntry *prev;
+    struct KeystreamCacheEntry *next;
+    uint8_t key[64];
+    uint32_t length;
+    uint8_t keystream[];
+};
+
+// Entries are kept in a list ordered from most to least recently used. A file only has a handful of
+// streams, so a linear search is cheaper than generating even the shortest of them.
+struct KeystreamCache
+{
+    struct KeystreamCacheEntry *head;
+    struct KeystreamCacheEntry *tail;
+    size_t usedBytes;
+    size_t maxBytes;
+};
+
+struct KeystreamCache CRYPTER_EXPORT *createKeystreamCache(size_t maxBytes)
+{
+    struct KeystreamCache *cache = (struct KeystreamCache *)calloc(1, sizeof(struct KeystreamCache));
+    if (cache)
+        cache->maxBytes = maxBytes;
+    return cache;
+}
+
+void CRYPTER_EXPORT clearKeystreamCache(struct KeystreamCache *cache)
+{
+    struct KeystreamCacheEntry *entry = cache->head;
+    while (entry) {
+        struct KeystreamCacheEntry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    cache->head = cache->tail = NULL;
+    cache->usedBytes = 0;
+}
+
+void CRYPTER_EXPORT destroyKeystreamCache(struct KeystreamCache *cache)
+{
+    if (!cache)
+        return;
+    clearKeystreamCache(cache);
+    free(cache);
+}
+
+static void unlinkCacheEntry(struct KeystreamCache *cache, struct KeystreamCacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+}
+
+static void pushCacheEntry(struct KeystreamCache *cache, struct KeystreamCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+    cache->head = entry;
+}
+
+// Same as cryptStream, but takes the keystream from cache if possible, and adds it otherwise.
+// Streams that do not fit into the cache at all are crypted directly.
+static void cryptStreamCached(uint8_t *output, const uint8_t *key, const uint8_t *input, uint32_t length, struct KeystreamCache *cache)
+{
+    if (!cache || !length) {
+        cryptStream(output, key, input, length);
+        return;
+    }
+
+    for (struct KeystreamCacheEntry *entry = cache->head; entry; entry = entry->next) {
+        if (entry->length == length && !memcmp(entry->key, key, 64)) {
+            if (entry != cache->head) {
+                unlinkCacheEntry(cache, entry);
+                pushCacheEntry(cache, entry);
+            }
+            xorKeystream(output, input, entry->keystream, length);
+            return;
+        }
+    }
+
+    size_t entrySize = sizeof(struct KeystreamCacheEntry) + KEYSTREAM_SIZE(length);
+    if (entrySize > cache->maxBytes) {
+        cryptStream(output, key, input, length);
+        return;
+    }
+    while (cache->usedBytes + entrySize > cache->maxBytes) {
+        struct KeystreamCacheEntry *victim = cache->tail;
+        unlinkCacheEntry(cache, victim);
+        cache->usedBytes -= sizeof(struct KeystreamCacheEntry) + KEYSTREAM_SIZE(victim->length);
+        free(victim);
+    }
+
+    struct KeystreamCacheEntry *entry = (struct KeystreamCacheEntry *)malloc(entrySize);
+    if (!entry) {
+        cryptStream(output, key, input, length);
+        return;
+    }
+    memcpy(entry->key, key, 64);
+    entry->length = length;
+    generateKeystream(entry->keystream, key, length);
+    pushCacheEntry(cache, entry);
+    cache->usedBytes += entrySize;
+
+    xorKeystream(output, input, entry->keystream, length);
+}
+
+static void cryptHeaderCached(uint8_t *output, const uint8_t *input, const uint8_t *shuffledMasterKey, struct KeystreamCache *cache)
+{
+    uint8_t headerSeed[64], headerKey[64];
+
+    // Keep a copy of the seed, as output may be the same as input.
+    memcpy(headerSeed, &input[256], 64);
+    memcpy(headerKey, headerSeed, 64);
     xorRepeatingBlocks(headerKey, shuffledMasterKey, 64);
-    cryptStream(output, headerKey, input, ENCRYPTION_HEADER_SIZE);
-    memcpy(&output[256], &input[256], 64);
+    TRACE_BEGIN(header);
+    cryptStreamCached(output, headerKey, input, ENCRYPTION_HEADER_SIZE, cache);
+    TRACE_END(header, "encryption header", NULL, ENCRYPTION_HEADER_SIZE);
+    memcpy(&output[256], headerSeed, 64);
+}
+
+void cryptHeader(uint8_t *output, const uint8_t *input, const uint8_t *shuffledMasterKey)
+{
+    cryptHeaderCached(output, input, shuffledMasterKey, NULL);
+}
+
+// Total size of a file with the given header.
+static uint64_t getFileSize(const struct FileHeader *header, const struct MasterKeyInfo *masterKey)
+{
+    return (uint64_t)ENCRYPTION_HEADER_SIZE
+         + masterKey->fileHeaderSize
+         + header->descSize
+         + header->logoSize
+         + header->dataSize
+         + (uint64_t)header->serialLength*2;
+}
+
+// Encrypt or decrypt a single block of a file, given its decrypted encryption header.
+// Blocks are numbered in file order: description, logo, data, serial. Output may be the same as input.
+// This allows patching single blocks of an encrypted file without touching the rest of it.
+void CRYPTER_EXPORT cryptBlock(uint8_t *output, const uint8_t *input, uint32_t size, int block, const uint8_t *encryptionHeader)
+{
+    uint8_t rollingKey[64], intermediateKey[64];
+    memcpy(rollingKey, encryptionHeader, 64);
+    xorRepeatingBlocks(rollingKey, &encryptionHeader[64], 256);
+
+    xorWithLongParam(rollingKey, intermediateKey, block);
+    TRACE_BEGIN(block);
+    cryptStream(output, intermediateKey, input, size);
+    TRACE_END(block, TRACE_BLOCK_NAME(block), NULL, size);
 }
 
-void decryptWithKey(struct FileDescriptor *descriptor, const uint8_t *input, const char *masterKey)
+// Crypt the blocks following the file header, which are stored in the same order in both the
+// encrypted and the decrypted image. Output may be the same as input.
+static void cryptImageBlocks(uint8_t *output, const uint8_t *input, const uint8_t *rollingKey, const struct FileHeader *header,
+                             struct KeystreamCache *cache)
+{
+    uint32_t sizes[4] = { header->descSize, header->logoSize, header->dataSize, header->serialLength*2 };
+    uint8_t intermediateKey[64];
+
+    for (int i = 0; i < 4; ++i) {
+        xorWithLongParam(rollingKey, intermediateKey, i);
+        TRACE_BEGIN(block);
+        cryptStreamCached(output, intermediateKey, input, sizes[i], cache);
+        TRACE_END(block, TRACE_BLOCK_NAME(i), NULL, sizes[i]);
+        output += sizes[i];
+        input += sizes[i];
+    }
+}
+
+// Decrypt only the file header of the data at input, e.g. to find out the file type.
+void CRYPTER_EXPORT decryptHeaderWithKeyInfo(struct FileHeader *header, const uint8_t *input, const struct MasterKeyInfo *masterKey)
+{
+    uint8_t encryptionHeader[ENCRYPTION_HEADER_SIZE];
+    cryptHeader(encryptionHeader, input, masterKey->shuffledKey);
+
+    uint8_t rollingKey[64], intermediateKey[64];
+    memcpy(rollingKey, encryptionHeader, 64);
+    xorRepeatingBlocks(rollingKey, &encryptionHeader[64], 256);
+
+    memset(header, 0, sizeof(struct FileHeader));
+    xorWithLongParam(rollingKey, intermediateKey, masterKey->fileHeaderSize);
+    cryptStream((uint8_t *)header, intermediateKey, &input[ENCRYPTION_HEADER_SIZE], masterKey->fileHeaderSize);
+}
+
+void CRYPTER_EXPORT decryptWithKeyInfo(struct FileDescriptor *descriptor, const uint8_t *input, const struct MasterKeyInfo *masterKey)
 {
     descriptor->encryptionHeader = (uint8_t *)malloc(ENCRYPTION_HEADER_SIZE);
-    descriptor->fileHeader       = (struct FileHeader *)malloc(sizeof(struct FileHeader));
+    descriptor->fileHeader       = (struct FileHeader *)calloc(1, sizeof(struct FileHeader));
 
-    cryptHeader(descriptor->encryptionHeader, input, masterKey);
+    cryptHeader(descriptor->encryptionHeader, input, masterKey->shuffledKey);
     input += ENCRYPTION_HEADER_SIZE;
 
     uint8_t rollingKey[64], intermediateKey[64];
     memcpy(rollingKey, descriptor->encryptionHeader, 64);
     xorRepeatingBlocks(rollingKey, &descriptor->encryptionHeader[64], 256);
 
-    xorWithLongParam(rollingKey, intermediateKey, sizeof(struct FileHeader));
-    cryptStream((uint8_t *)descriptor->fileHeader, intermediateKey, input, sizeof(struct FileHeader));
-    input += sizeof(struct FileHeader);
+    xorWithLongParam(rollingKey, intermediateKey, masterKey->fileHeaderSize);
+    cryptStream((uint8_t *)descriptor->fileHeader, intermediateKey, input, masterKey->fileHeaderSize);
+    input += masterKey->fileHeaderSize;
 
     descriptor->data        = (uint8_t *)malloc(descriptor->fileHeader->dataSize);
     descriptor->logo        = (uint8_t *)malloc(descriptor->fileHeader->logoSize);
@@ -149,10 +417,45 @@ void decryptWithKey(struct FileDescriptor *descriptor, const uint8_t *input, con
     cryptStream(descriptor->serial, intermediateKey, input, descriptor->fileHeader->serialLength*2);
 }
 
-uint8_t *encryptWithKey(const struct FileDescriptor *descriptor, int *size, const char *masterKey)
+// Encrypt descriptor into output, which must be large enough to hold the whole file.
+static void encryptDescriptor(uint8_t *output, const struct FileDescriptor *descriptor, const struct MasterKeyInfo *masterKey,
+                              struct KeystreamCache *cache)
+{
+    cryptHeaderCached(output, descriptor->encryptionHeader, masterKey->shuffledKey, cache);
+    output += ENCRYPTION_HEADER_SIZE;
+
+    uint8_t rollingKey[64], intermediateKey[64];
+    memcpy(rollingKey, descriptor->encryptionHeader, 64);
+    xorRepeatingBlocks(rollingKey, &descriptor->encryptionHeader[64], 256);
+
+    xorWithLongParam(rollingKey, intermediateKey, masterKey->fileHeaderSize);
+    TRACE_BEGIN(header);
+    cryptStreamCached(output, intermediateKey, (uint8_t *)descriptor->fileHeader, masterKey->fileHeaderSize, cache);
+    TRACE_END(header, "file header", NULL, masterKey->fileHeaderSize);
+    output += masterKey->fileHeaderSize;
+
+    const uint8_t *blocks[4] = { descriptor->description, descriptor->logo, descriptor->data, descriptor->serial };
+    uint32_t sizes[4] = {
+        descriptor->fileHeader->descSize, descriptor->fileHeader->logoSize,
+        descriptor->fileHeader->dataSize, descriptor->fileHeader->serialLength*2
+    };
+    for (int i = 0; i < 4; ++i) {
+        xorWithLongParam(rollingKey, intermediateKey, i);
+        TRACE_BEGIN(block);
+        cryptStreamCached(output, intermediateKey, blocks[i], sizes[i], cache);
+        TRACE_END(block, TRACE_BLOCK_NAME(i), NULL, sizes[i]);
+        output += sizes[i];
+    }
+}
+
+// Same as encryptWithKeyInfo, but the keystreams are taken from cache if it holds them and added to it
+// otherwise. As the keystreams only depend on the encryption header, the master key and the block sizes,
+// encrypting the same file again after editing it is reduced to XORing it with the cached keystreams.
+uint8_t CRYPTER_EXPORT *encryptWithKeyInfoCached(const struct FileDescriptor *descriptor, int *size, const struct MasterKeyInfo *masterKey,
+                                                 struct KeystreamCache *cache)
 {
     *size = ENCRYPTION_HEADER_SIZE
-          + sizeof(struct FileHeader)
+          + masterKey->fileHeaderSize
           + descriptor->fileHeader->dataSize
           + descriptor->fileHeader->logoSize
           + descriptor->fileHeader->descSize
@@ -162,35 +465,199 @@ uint8_t *encryptWithKey(const struct FileDescriptor *descriptor, int *size, cons
     if (!result)
         return NULL;
 
-    uint8_t *output = result;
+    encryptDescriptor(result, descriptor, masterKey, cache);
+    return result;
+}
 
-    cryptHeader(output, descriptor->encryptionHeader, masterKey);
-    output += ENCRYPTION_HEADER_SIZE;
+uint8_t CRYPTER_EXPORT *encryptWithKeyInfo(const struct FileDescriptor *descriptor, int *size, const struct MasterKeyInfo *masterKey)
+{
+    return encryptWithKeyInfoCached(descriptor, size, masterKey, NULL);
+}
+
+// Decrypt just the headers of the size bytes at input and check that they describe a file of exactly
+// that size, with no block larger than maxBlockSize. This only takes a few microseconds and does not
+// allocate, so broken files or files encrypted with a different key are turned down cheaply.
+static int decryptAndCheckHeaders(uint8_t *encryptionHeader, struct FileHeader *header, const uint8_t *input, uint32_t size,
+                                  const struct MasterKeyInfo *masterKey, uint32_t maxBlockSize)
+{
+    if (size < ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize)
+        return CRYPT_ERROR_INVALID_SIZE;
+
+    cryptHeader(encryptionHeader, input, masterKey->shuffledKey);
 
     uint8_t rollingKey[64], intermediateKey[64];
-    memcpy(rollingKey, descriptor->encryptionHeader, 64);
-    xorRepeatingBlocks(rollingKey, &descriptor->encryptionHeader[64], 256);
+    memcpy(rollingKey, encryptionHeader, 64);
+    xorRepeatingBlocks(rollingKey, &encryptionHeader[64], 256);
+
+    memset(header, 0, sizeof(struct FileHeader));
+    xorWithLongParam(rollingKey, intermediateKey, masterKey->fileHeaderSize);
+    TRACE_BEGIN(fileHeader);
+    cryptStream((uint8_t *)header, intermediateKey, &input[ENCRYPTION_HEADER_SIZE], masterKey->fileHeaderSize);
+    TRACE_END(fileHeader, "file header", NULL, masterKey->fileHeaderSize);
+
+    if (getFileSize(header, masterKey) != size)
+        return CRYPT_ERROR_INVALID_SIZE;
+    if (header->descSize > maxBlockSize || header->logoSize > maxBlockSize || header->dataSize > maxBlockSize
+        || (uint64_t)header->serialLength*2 > maxBlockSize)
+        return CRYPT_ERROR_BLOCK_TOO_LARGE;
+
+    return CRYPT_OK;
+}
 
-    xorWithLongParam(rollingKey, intermediateKey, sizeof(struct FileHeader));
-    cryptStream(output, intermediateKey, (uint8_t *)descriptor->fileHeader, sizeof(struct FileHeader));
-    output += sizeof(struct FileHeader);
+// Check whether the size bytes at input are a valid file for masterKey without decrypting it.
+// Only the first ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize bytes of input are read, so it is enough to
+// pass the headers of a file along with the size of the whole file.
+// If header is not NULL, the decrypted file header is stored there. A maxBlockSize of 0 selects DEFAULT_MAX_BLOCK_SIZE.
+int CRYPTER_EXPORT validateWithKeyInfo(struct FileHeader *header, const uint8_t *input, uint32_t size,
+                                       const struct MasterKeyInfo *masterKey, uint32_t maxBlockSize)
+{
+    uint8_t encryptionHeader[ENCRYPTION_HEADER_SIZE];
+    struct FileHeader scratch;
+    return decryptAndCheckHeaders(encryptionHeader, header ? header : &scratch, input, size, masterKey,
+                                  maxBlockSize ? maxBlockSize : DEFAULT_MAX_BLOCK_SIZE);
+}
 
-    xorWithLongParam(rollingKey, intermediateKey, 0);
-    cryptStream(output, intermediateKey, descriptor->description, descriptor->fileHeader->descSize);
-    output += descriptor->fileHeader->descSize;
+// Length-aware version of decryptWithKeyInfo. The input is validated before anything is allocated;
+// if it is invalid, an error is returned and descriptor is left untouched.
+// A maxBlockSize of 0 selects DEFAULT_MAX_BLOCK_SIZE.
+int CRYPTER_EXPORT decryptWithKeyInfoChecked(struct FileDescriptor *descriptor, const uint8_t *input, uint32_t size,
+                                             const struct MasterKeyInfo *masterKey, uint32_t maxBlockSize)
+{
+    uint8_t encryptionHeader[ENCRYPTION_HEADER_SIZE];
+    struct FileHeader header;
+    int result = decryptAndCheckHeaders(encryptionHeader, &header, input, size, masterKey,
+                                        maxBlockSize ? maxBlockSize : DEFAULT_MAX_BLOCK_SIZE);
+    if (result)
+        return result;
 
-    xorWithLongParam(rollingKey, intermediateKey, 1);
-    cryptStream(output, intermediateKey, descriptor->logo, descriptor->fileHeader->logoSize);
-    output += descriptor->fileHeader->logoSize;
+    descriptor->encryptionHeader = (uint8_t *)malloc(ENCRYPTION_HEADER_SIZE);
+    descriptor->fileHeader       = (struct FileHeader *)malloc(sizeof(struct FileHeader));
+    descriptor->description      = (uint8_t *)malloc(header.descSize ? header.descSize : 1);
+    descriptor->logo             = (uint8_t *)malloc(header.logoSize ? header.logoSize : 1);
+    descriptor->data             = (uint8_t *)malloc(header.dataSize ? header.dataSize : 1);
+    descriptor->serial           = (uint8_t *)malloc(header.serialLength ? header.serialLength*2 : 1);
+    if (!descriptor->encryptionHeader || !descriptor->fileHeader || !descriptor->description
+        || !descriptor->logo || !descriptor->data || !descriptor->serial)
+        return CRYPT_ERROR_OUT_OF_MEMORY;
+
+    memcpy(descriptor->encryptionHeader, encryptionHeader, ENCRYPTION_HEADER_SIZE);
+    memcpy(descriptor->fileHeader, &header, sizeof(struct FileHeader));
+
+    uint8_t *blocks[4] = { descriptor->description, descriptor->logo, descriptor->data, descriptor->serial };
+    uint32_t sizes[4]  = { header.descSize, header.logoSize, header.dataSize, header.serialLength*2 };
+    input += ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize;
+    for (int i = 0; i < 4; ++i) {
+        cryptBlock(blocks[i], input, sizes[i], i, encryptionHeader);
+        input += sizes[i];
+    }
 
-    xorWithLongParam(rollingKey, intermediateKey, 2);
-    cryptStream(output, intermediateKey, descriptor->data, descriptor->fileHeader->dataSize);
-    output += descriptor->fileHeader->dataSize;
+    return CRYPT_OK;
+}
 
-    xorWithLongParam(rollingKey, intermediateKey, 3);
-    cryptStream(output, intermediateKey, descriptor->serial, descriptor->fileHeader->serialLength*2);
+// Decrypt the size bytes at input into a decrypted image of the same size at output.
+// The image holds the encryption header, the file header and all blocks in file order, so no
+// allocations are needed. Output may be the same as input to decrypt in place.
+int CRYPTER_EXPORT decryptImage(uint8_t *output, const uint8_t *input, uint32_t size, const struct MasterKeyInfo *masterKey)
+{
+    TRACE_BEGIN(image);
 
-    return result;
+    // The caller already provides the memory, so there is no need to limit the block size.
+    uint8_t encryptionHeader[ENCRYPTION_HEADER_SIZE];
+    struct FileHeader header;
+    int result = decryptAndCheckHeaders(encryptionHeader, &header, input, size, masterKey, UINT32_MAX);
+    if (result)
+        return result;
+
+    uint8_t rollingKey[64];
+    memcpy(rollingKey, encryptionHeader, 64);
+    xorRepeatingBlocks(rollingKey, &encryptionHeader[64], 256);
+
+    memcpy(output, encryptionHeader, ENCRYPTION_HEADER_SIZE);
+    memcpy(&output[ENCRYPTION_HEADER_SIZE], &header, masterKey->fileHeaderSize);
+
+    uint32_t offset = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize;
+    cryptImageBlocks(&output[offset], &input[offset], rollingKey, &header, NULL);
+
+    TRACE_END(image, "decrypt image", NULL, size);
+    return CRYPT_OK;
+}
+
+// Encrypt a decrypted image of size bytes at input, as produced by decryptImage, into output.
+// Output may be the same as input to encrypt in place. If cache is not NULL, keystreams are taken
+// from and added to it, just like with encryptWithKeyInfoCached.
+int CRYPTER_EXPORT encryptImageCached(uint8_t *output, const uint8_t *input, uint32_t size, const struct MasterKeyInfo *masterKey,
+                                      struct KeystreamCache *cache)
+{
+    TRACE_BEGIN(image);
+
+    if (size < ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize)
+        return CRYPT_ERROR_INVALID_SIZE;
+
+    struct FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, &input[ENCRYPTION_HEADER_SIZE], masterKey->fileHeaderSize);
+    if (getFileSize(&header, masterKey) != size)
+        return CRYPT_ERROR_INVALID_SIZE;
+
+    uint8_t rollingKey[64], intermediateKey[64];
+    memcpy(rollingKey, input, 64);
+    xorRepeatingBlocks(rollingKey, &input[64], 256);
+
+    cryptHeaderCached(output, input, masterKey->shuffledKey, cache);
+
+    xorWithLongParam(rollingKey, intermediateKey, masterKey->fileHeaderSize);
+    TRACE_BEGIN(fileHeader);
+    cryptStreamCached(&output[ENCRYPTION_HEADER_SIZE], intermediateKey, (uint8_t *)&header, masterKey->fileHeaderSize, cache);
+    TRACE_END(fileHeader, "file header", NULL, masterKey->fileHeaderSize);
+
+    uint32_t offset = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize;
+    cryptImageBlocks(&output[offset], &input[offset], rollingKey, &header, cache);
+
+    TRACE_END(image, "encrypt image", NULL, size);
+    return CRYPT_OK;
+}
+
+int CRYPTER_EXPORT encryptImage(uint8_t *output, const uint8_t *input, uint32_t size, const struct MasterKeyInfo *masterKey)
+{
+    return encryptImageCached(output, input, size, masterKey, NULL);
+}
+
+// Look up a raw master key in the registry, so that the file header size of its game version is used.
+// Unknown keys are prepared on the fly and assume the file header of PES 2016 and 2017.
+static const struct MasterKeyInfo *resolveMasterKey(const char *masterKey, struct MasterKeyInfo *scratch)
+{
+    const struct MasterKeyInfo *result = findMasterKeyByData((const uint8_t *)masterKey);
+    if (result)
+        return result;
+
+    initMasterKeyInfo(scratch, "", 0, (const uint8_t *)masterKey);
+    return scratch;
+}
+
+// Decrypt only the file header of the data at input, e.g. to find out the file type.
+void CRYPTER_EXPORT decryptHeaderWithKey(struct FileHeader *header, const uint8_t *input, const char *masterKey)
+{
+    struct MasterKeyInfo scratch;
+    decryptHeaderWithKeyInfo(header, input, resolveMasterKey(masterKey, &scratch));
+}
+
+int CRYPTER_EXPORT decryptWithKeyChecked(struct FileDescriptor *descriptor, const uint8_t *input, uint32_t size,
+                                         const char *masterKey, uint32_t maxBlockSize)
+{
+    struct MasterKeyInfo scratch;
+    return decryptWithKeyInfoChecked(descriptor, input, size, resolveMasterKey(masterKey, &scratch), maxBlockSize);
+}
+
+void CRYPTER_EXPORT decryptWithKey(struct FileDescriptor *descriptor, const uint8_t *input, const char *masterKey)
+{
+    struct MasterKeyInfo scratch;
+    decryptWithKeyInfo(descriptor, input, resolveMasterKey(masterKey, &scratch));
+}
+
+uint8_t CRYPTER_EXPORT *encryptWithKey(const struct FileDescriptor *descriptor, int *size, const char *masterKey)
+{
+    struct MasterKeyInfo scratch;
+    return encryptWithKeyInfo(descriptor, size, resolveMasterKey(masterKey, &scratch));
 }
 
 struct FileDescriptor CRYPTER_EXPORT *createFileDescriptor()
@@ -215,25 +682,87 @@ void CRYPTER_EXPORT destroyFileDescriptor(struct FileDescriptor *desc)
 //encrypter & decrypter helpers ...
 uint8_t *readFile(const char *path, uint32_t *sizePtr)
 {
+    TRACE_BEGIN(read);
     FILE *inStream = fopen(path, "rb");
     if (!inStream)
         return NULL;
 
     struct stat file;
-    if (stat(path, &file))
+    if (stat(path, &file)) {
+        fclose(inStream);
         return NULL;
+    }
     int size = file.st_size;
 
     uint8_t *input = (uint8_t *)malloc(size);
-    fread(input, 1, size, inStream);
+    if (input && fread(input, 1, size, inStream) != (size_t)size) {
+        free(input);
+        input = NULL;
+    }
     fclose(inStream);
+    if (!input)
+        return NULL;
 
     if (sizePtr)
         *sizePtr = size;
 
+    TRACE_END(read, "read", path, size);
     return input;
 }
 
+// Read the file at path, but check its headers with validateWithKeyInfo first, so that invalid files are
+// turned down before their body is read or any memory is allocated for it. If header is not NULL, the
+// decrypted file header is stored there. If data is NULL, only the headers are read and checked.
+// Returns CRYPT_OK, CRYPT_ERROR_IO if the file could not be read, or the error of validateWithKeyInfo.
+int readFileChecked(const char *path, const struct MasterKeyInfo *masterKey, struct FileHeader *header, uint8_t **data, uint32_t *sizePtr)
+{
+    TRACE_BEGIN(read);
+    FILE *inStream = fopen(path, "rb");
+    if (!inStream)
+        return CRYPT_ERROR_IO;
+
+    struct stat file;
+    if (stat(path, &file)) {
+        fclose(inStream);
+        return CRYPT_ERROR_IO;
+    }
+    if ((uint64_t)file.st_size > UINT32_MAX) {
+        fclose(inStream);
+        return CRYPT_ERROR_INVALID_SIZE;
+    }
+    uint32_t size = (uint32_t)file.st_size;
+
+    uint8_t headers[ENCRYPTION_HEADER_SIZE + sizeof(struct FileHeader)];
+    uint32_t headerSize = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize;
+    if (size < headerSize)
+        headerSize = size;
+    int result = fread(headers, 1, headerSize, inStream) == headerSize ? CRYPT_OK : CRYPT_ERROR_IO;
+    if (!result)
+        result = validateWithKeyInfo(header, headers, size, masterKey, 0);
+
+    if (!result && data) {
+        *data = (uint8_t *)malloc(size);
+        if (!*data) {
+            result = CRYPT_ERROR_OUT_OF_MEMORY;
+        }
+        else {
+            memcpy(*data, headers, headerSize);
+            if (fread(&(*data)[headerSize], 1, size - headerSize, inStream) != size - headerSize) {
+                free(*data);
+                *data = NULL;
+                result = CRYPT_ERROR_IO;
+            }
+        }
+    }
+    fclose(inStream);
+
+    if (!result && sizePtr)
+        *sizePtr = size;
+
+    TRACE_END(read, "read", path, size);
+    return result;
+}
+
 uint8_t *readFileDir(const char *dirName, const char *fileName, uint32_t *sizePtr)
 {
     char *path = (char *)malloc(strlen(dirName) + strlen(fileName) + 2);
@@ -246,75 +775,372 @@ uint8_t *readFileDir(const char *dirName, const char *fileName, uint32_t *sizePt
     return result;
 }
 
-void writeFile(const char *path, const uint8_t *data, int size)
+// Write size bytes of data to the file at path.
+// Returns CRYPT_OK on success and CRYPT_ERROR_IO if the file could not be written completely.
+int writeFile(const char *path, const uint8_t *data, int size)
 {
+    TRACE_BEGIN(write);
     FILE *outStream = fopen(path, "wb");
     if (!outStream)
-        return;
-    fwrite(data, 1, size, outStream);
-    fclose(outStream);
+        return CRYPT_ERROR_IO;
+    size_t written = fwrite(data, 1, size, outStream);
+    if (fclose(outStream) || written != (size_t)size)
+        return CRYPT_ERROR_IO;
+    TRACE_END(write, "write", path, size);
+    return CRYPT_OK;
 }
 
-void writeFileDir(const char *dirName, const char *fileName, const uint8_t *data, int size)
+int writeFileDir(const char *dirName, const char *fileName, const uint8_t *data, int size)
 {
     struct stat dir;
-    if (stat(dirName, &dir))
+    if (stat(dirName, &dir)) {
+        TRACE_BEGIN(mkdir);
 #ifdef __unix__
-        mkdir(dirName, 0777);
+        if (mkdir(dirName, 0777) && errno != EEXIST)
 #else
-        mkdir(dirName);
+        if (mkdir(dirName))
 #endif
+            return CRYPT_ERROR_IO;
+        TRACE_END(mkdir, "mkdir", dirName, 0);
+    }
 
     char *path = (char *)malloc(strlen(dirName) + strlen(fileName) + 2);
+    if (!path)
+        return CRYPT_ERROR_OUT_OF_MEMORY;
     sprintf(path, "%s/%s", dirName, fileName);
 
-    writeFile(path, data, size);
+    int result = writeFile(path, data, size);
 
     free(path);
+    return result;
 }
 
+// Copy the file type string of header into output, which must hold sizeof(header->fileTypeString) + 1 bytes.
+// Characters other than printable ASCII are replaced, so the result is safe to put into tab-separated lines,
+// and an empty file type is turned into "-".
+void copyFileType(char *output, const struct FileHeader *header)
+{
+    int i;
+    for (i = 0; i < (int)sizeof(header->fileTypeString) && header->fileTypeString[i]; ++i) {
+        uint8_t c = header->fileTypeString[i];
+        output[i] = (c >= 0x20 && c < 0x7F) ? c : '?';
+    }
+    if (!i)
+        output[i++] = '-';
+    output[i] = '\0';
+}
 
-void CRYPTER_EXPORT decryptWithKey_ex(const char *pathIn, const char *pathOut, const char *masterKey)
+#ifdef __unix__
+// Write size bytes of data to the file fd, retrying short writes.
+// Returns CRYPT_OK on success and CRYPT_ERROR_IO if the data could not be written completely.
+static int writeAll(int fd, const uint8_t *data, size_t size)
 {
-    uint8_t *input = readFile(pathIn, NULL);
-    if (!input) {
-        #ifndef BUILDING_LIBRARY
-            printf("Unable to open input file");
-        #endif
+    for (size_t written = 0; written < size; ) {
+        ssize_t count = write(fd, &data[written], size - written);
+        if (count > 0)
+            written += (size_t)count;
+        else if (count < 0 && errno != EINTR)
+            return CRYPT_ERROR_IO;
+    }
+    return CRYPT_OK;
+}
+
+// Encrypt descriptor straight into a memory mapping of the empty file fd, which is resized to size bytes.
+static int encryptIntoFile(int fd, size_t size, const struct FileDescriptor *descriptor, const struct MasterKeyInfo *masterKey)
+{
+    // Reserve the disk space up front, so that running out of it is an error here instead of a SIGBUS
+    // while writing to the mapping. File systems that cannot do so get a buffered write instead.
+    TRACE_BEGIN(allocate);
+    int error = posix_fallocate(fd, 0, size);
+    if (error == EINVAL || error == EOPNOTSUPP) {
+        TRACE_END(allocate, "allocate", NULL, 0);
+        uint8_t *output = (uint8_t *)malloc(size);
+        if (!output)
+            return CRYPT_ERROR_OUT_OF_MEMORY;
+        encryptDescriptor(output, descriptor, masterKey, NULL);
+        int result = writeAll(fd, output, size);
+        free(output);
+        return (result || fsync(fd)) ? CRYPT_ERROR_IO : CRYPT_OK;
+    }
+    if (error)
+        return CRYPT_ERROR_IO;
+
+    uint8_t *output = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (output == MAP_FAILED)
+        return CRYPT_ERROR_IO;
+    TRACE_END(allocate, "allocate", NULL, size);
+
+    encryptDescriptor(output, descriptor, masterKey, NULL);
+
+    TRACE_BEGIN(sync);
+    int result = msync(output, size, MS_SYNC) ? CRYPT_ERROR_IO : CRYPT_OK;
+    if (munmap(output, size) || fsync(fd))
+        result = CRYPT_ERROR_IO;
+    TRACE_END(sync, "sync", NULL, size);
+    return result;
+}
+
+// Create a temporary file in the same folder as path, which replaceWithTempFile later renames to path.
+// It is named .name.XXXXXX after the file name at path, so that tools scanning the folder skip it. If the process
+// is killed before the rename, it is left behind and may be removed. Returns its file descriptor, or -1 on failure,
+// and stores its path in tempPath, which the caller has to free.
+static int createTempFile(const char *path, char **tempPath)
+{
+    const char *name = strrchr(path, '/');
+    int dirLength = name ? (int)(name - path + 1) : 0;
+    name = name ? name + 1 : path;
+
+    *tempPath = (char *)malloc(dirLength + strlen(name) + 9);
+    if (!*tempPath)
+        return -1;
+
+    // A file that is replaced keeps its mode. A new one gets the mode of files created by fopen,
+    // i.e. whatever the umask leaves of 0666, which mkstemp would not respect.
+    struct stat file;
+    int replacing = !stat(path, &file);
+
+    // The suffix does not have to be unpredictable, only unique, which O_EXCL ensures.
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    uint32_t seed = (uint32_t)getpid()*2654435761u ^ (uint32_t)(uintptr_t)tempPath ^ (uint32_t)clock();
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        char suffix[7];
+        for (int i = 0; i < 6; ++i) {
+            seed = seed*1664525 + 1013904223;
+            suffix[i] = digits[(seed >> 16) % 36];
+        }
+        suffix[6] = '\0';
+        sprintf(*tempPath, "%.*s.%s.%s", dirLength, path, name, suffix);
+
+        int fd = open(*tempPath, O_RDWR | O_CREAT | O_EXCL, replacing ? 0600 : 0666);
+        if (fd >= 0) {
+            if (replacing)
+                fchmod(fd, file.st_mode & 07777);
+            return fd;
+        }
+        if (errno != EEXIST)
+            break;
+    }
+
+    free(*tempPath);
+    *tempPath = NULL;
+    return -1;
+}
+
+// Flush the folder containing path to disk, so that a file renamed into it survives a crash.
+// This is done on a best effort basis: once the rename is done, the file has been replaced either way,
+// and some file systems cannot sync folders at all.
+static void syncParentFolder(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    char *dirPath = (char *)malloc(name ? (size_t)(name - path) + 2 : 2);
+    if (!dirPath)
         return;
+    if (name)
+        sprintf(dirPath, "%.*s", name == path ? 1 : (int)(name - path), path);
+    else
+        strcpy(dirPath, ".");
+
+    int fd = open(dirPath, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
     }
+    free(dirPath);
+}
+#endif
 
-    struct FileDescriptor *descriptor = createFileDescriptor();
-    decryptWithKey(descriptor, input, masterKey);
+// Rename the temporary file at tempPath to path if result is CRYPT_OK, or remove it otherwise.
+// Frees tempPath and returns the final result, which is CRYPT_OK whenever the rename succeeded.
+static int replaceWithTempFile(char *tempPath, const char *path, int result)
+{
+    TRACE_BEGIN(rename);
+#ifdef _WIN32
+    // rename does not replace existing files on Windows.
+    if (!result && !MoveFileExA(tempPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        result = CRYPT_ERROR_IO;
+#else
+    if (!result && rename(tempPath, path))
+        result = CRYPT_ERROR_IO;
+#endif
+#ifdef __unix__
+    if (!result)
+        syncParentFolder(path);
+#endif
+    TRACE_END(rename, "rename", path, 0);
+
+    // Once renamed, there is no temporary file left to remove.
+    if (result)
+        remove(tempPath);
+
+    free(tempPath);
+    return result;
+}
+
+// Replace the file at path with size bytes of data, going through a temporary file like encryptWithKeyInfoToFile.
+// Returns CRYPT_OK on success and CRYPT_ERROR_IO if the file could not be written.
+int replaceFile(const char *path, const uint8_t *data, uint32_t size)
+{
+    char *tempPath;
+#ifdef __unix__
+    int fd = createTempFile(path, &tempPath);
+    if (fd < 0)
+        return CRYPT_ERROR_IO;
+
+    TRACE_BEGIN(write);
+    int result = writeAll(fd, data, size);
+    if (fsync(fd))
+        result = CRYPT_ERROR_IO;
+    if (close(fd))
+        result = CRYPT_ERROR_IO;
+    TRACE_END(write, "write", path, size);
+#else
+    tempPath = (char *)malloc(strlen(path) + 5);
+    if (!tempPath)
+        return CRYPT_ERROR_OUT_OF_MEMORY;
+    sprintf(tempPath, "%s.tmp", path);
+
+    int result = writeFile(tempPath, data, (int)size);
+#endif
+
+    return replaceWithTempFile(tempPath, path, result);
+}
+
+// Encrypt descriptor into the file at path.
+// The file is written to a temporary file in the same folder first, which then replaces the file at path,
+// so that no partially written file is left at path if writing fails or the process is killed midway.
+// A process that is killed midway leaves the temporary file behind, though (see createTempFile).
+// On Unix, the temporary file is mapped into memory and encrypted into directly, without buffering the whole file,
+// unless the file system cannot reserve its space up front.
+// Returns CRYPT_OK on success and CRYPT_ERROR_IO if the file could not be written.
+int CRYPTER_EXPORT encryptWithKeyInfoToFile(const struct FileDescriptor *descriptor, const char *path, const struct MasterKeyInfo *masterKey)
+{
+    uint64_t size = getFileSize(descriptor->fileHeader, masterKey);
+    if (size > INT32_MAX)
+        return CRYPT_ERROR_INVALID_SIZE;
+
+    char *tempPath;
+#ifdef __unix__
+    int fd = createTempFile(path, &tempPath);
+    if (fd < 0)
+        return CRYPT_ERROR_IO;
+
+    int result = encryptIntoFile(fd, size, descriptor, masterKey);
+    if (close(fd))
+        result = CRYPT_ERROR_IO;
+#else
+    tempPath = (char *)malloc(strlen(path) + 5);
+    if (!tempPath)
+        return CRYPT_ERROR_OUT_OF_MEMORY;
+    sprintf(tempPath, "%s.tmp", path);
+
+    int result = CRYPT_ERROR_OUT_OF_MEMORY;
+    uint8_t *output = (uint8_t *)malloc(size);
+    if (output) {
+        encryptDescriptor(output, descriptor, masterKey, NULL);
+        result = writeFile(tempPath, output, (int)size);
+        free(output);
+    }
+#endif
+
+    return replaceWithTempFile(tempPath, path, result);
+}
+
+
+// Decrypt the file at pathIn and put it out into folder pathOut.
+// The headers are checked before the rest of the file is read, see readFileChecked.
+// Returns CRYPT_OK on success, CRYPT_ERROR_IO if the input could not be read or the output could not be
+// written, or the error of decryptWithKeyInfoChecked if it is not a valid file.
+int CRYPTER_EXPORT decryptWithKeyInfo_ex(const char *pathIn, const char *pathOut, const struct MasterKeyInfo *masterKey)
+{
+    TRACE_BEGIN(file);
+    uint32_t size = 0;
+    uint8_t *input = NULL;
+    int result = readFileChecked(pathIn, masterKey, NULL, &input, &size);
+    if (result == CRYPT_ERROR_IO) {
+        #ifdef PRINT_MESSAGES
+            printf("Unable to open input file\n");
+        #endif
+        return result;
+    }
+
+    struct FileDescriptor *descriptor = NULL;
+    if (!result) {
+        descriptor = createFileDescriptor();
+        result = descriptor ? decryptWithKeyInfoChecked(descriptor, input, size, masterKey, 0) : CRYPT_ERROR_OUT_OF_MEMORY;
+    }
+    free(input);
+    if (result) {
+        #ifdef PRINT_MESSAGES
+            printf("Invalid input file\n");
+        #endif
+        if (descriptor)
+            destroyFileDescriptor(descriptor);
+        return result;
+    }
 
-    writeFileDir(pathOut, "encryptHeader.dat",     descriptor->encryptionHeader, ENCRYPTION_HEADER_SIZE);
-    writeFileDir(pathOut, "header.dat", (uint8_t *)descriptor->fileHeader,       sizeof(struct FileHeader));
-    writeFileDir(pathOut, "description.dat",       descriptor->description,      descriptor->fileHeader->descSize);
-    writeFileDir(pathOut, "logo.png",              descriptor->logo,             descriptor->fileHeader->logoSize);
-    writeFileDir(pathOut, "data.dat",              descriptor->data,             descriptor->fileHeader->dataSize);
-    writeFileDir(pathOut, "version.txt",           descriptor->serial,           descriptor->fileHeader->serialLength*2);
+    if (writeFileDir(pathOut, "encryptHeader.dat",     descriptor->encryptionHeader, ENCRYPTION_HEADER_SIZE)
+        || writeFileDir(pathOut, "header.dat", (uint8_t *)descriptor->fileHeader,       masterKey->fileHeaderSize)
+        || writeFileDir(pathOut, "description.dat",       descriptor->description,      descriptor->fileHeader->descSize)
+        || writeFileDir(pathOut, "logo.png",              descriptor->logo,             descriptor->fileHeader->logoSize)
+        || writeFileDir(pathOut, "data.dat",              descriptor->data,             descriptor->fileHeader->dataSize)
+        || writeFileDir(pathOut, "version.txt",           descriptor->serial,           descriptor->fileHeader->serialLength*2)) {
+        #ifdef PRINT_MESSAGES
+            printf("Unable to write output files\n");
+        #endif
+        result = CRYPT_ERROR_IO;
+    }
 
     destroyFileDescriptor(descriptor);
+    TRACE_END(file, "decrypt file", pathIn, size);
+    return result;
 }
 
 
-void CRYPTER_EXPORT encryptWithKey_ex(const char *pathIn, const char *pathOut, const char *masterKey)
+// Encrypt the folder pathIn and put it out into file pathOut, see encryptWithKeyInfoToFile.
+// Returns CRYPT_OK on success and CRYPT_ERROR_IO if any of the input files could not be read or the output could not be written.
+int CRYPTER_EXPORT encryptWithKeyInfo_ex(const char *pathIn, const char *pathOut, const struct MasterKeyInfo *masterKey)
 {
+    TRACE_BEGIN(file);
+    uint32_t headerSize;
     struct FileDescriptor *descriptor = createFileDescriptor();
     descriptor->encryptionHeader                = readFileDir(pathIn, "encryptHeader.dat", NULL);
-    descriptor->fileHeader = (struct FileHeader *)readFileDir(pathIn, "header.dat", NULL);
+    uint8_t *header                             = readFileDir(pathIn, "header.dat", &headerSize);
+    if (!descriptor->encryptionHeader || !header || headerSize < masterKey->fileHeaderSize) {
+        free(header);
+        destroyFileDescriptor(descriptor);
+        return CRYPT_ERROR_IO;
+    }
+    descriptor->fileHeader = (struct FileHeader *)calloc(1, sizeof(struct FileHeader));
+    memcpy(descriptor->fileHeader, header, masterKey->fileHeaderSize);
+    free(header);
+
     descriptor->description                     = readFileDir(pathIn, "description.dat", &descriptor->fileHeader->descSize);
     descriptor->logo                            = readFileDir(pathIn, "logo.png",        &descriptor->fileHeader->logoSize);
     descriptor->data                            = readFileDir(pathIn, "data.dat",        &descriptor->fileHeader->dataSize);
     descriptor->serial                          = readFileDir(pathIn, "version.txt",     &descriptor->fileHeader->serialLength);
     descriptor->fileHeader->serialLength /= 2;
+    if (!descriptor->description || !descriptor->logo || !descriptor->data || !descriptor->serial) {
+        destroyFileDescriptor(descriptor);
+        return CRYPT_ERROR_IO;
+    }
 
-    int outputSize;
-    uint8_t *output = encryptWithKey(descriptor, &outputSize, masterKey);
-
-    writeFile(pathOut, output, outputSize);
+    int result = encryptWithKeyInfoToFile(descriptor, pathOut, masterKey);
 
     destroyFileDescriptor(descriptor);
+    TRACE_END(file, "encrypt file", pathOut, 0);
+    return result;
+}
+
+int CRYPTER_EXPORT decryptWithKey_ex(const char *pathIn, const char *pathOut, const char *masterKey)
+{
+    struct MasterKeyInfo scratch;
+    return decryptWithKeyInfo_ex(pathIn, pathOut, resolveMasterKey(masterKey, &scratch));
+}
+
+int CRYPTER_EXPORT encryptWithKey_ex(const char *pathIn, const char *pathOut, const char *masterKey)
+{
+    struct MasterKeyInfo scratch;
+    return encryptWithKeyInfo_ex(pathIn, pathOut, resolveMasterKey(masterKey, &scratch));
 }
 
 
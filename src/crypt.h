@@ -28,6 +28,7 @@
 #ifndef _CRYPT_H
 #define _CRYPT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -48,6 +49,8 @@ extern "C" {
 
 #endif /* BUILDING_LIBRARY */
 
+#define ENCRYPTION_HEADER_SIZE 320
+
 struct FileHeader
 {
     uint8_t mysteryData[64];
@@ -57,11 +60,33 @@ struct FileHeader
     uint32_t serialLength;
     uint8_t hash[64];
     uint8_t fileTypeString[32];
-    #if USE_PES18_MASTER_KEY || USE_PES19_MASTER_KEY || USE_PES20_MASTER_KEY || USE_PES21_MASTER_KEY
-    uint8_t gameVersionString[32];
-    #endif
+    uint8_t gameVersionString[32]; // Only present in files of PES 2018 and later.
 };
 
+// Size of the file header as stored in the files of the respective game versions.
+#define FILE_HEADER_SIZE_PES16 (sizeof(struct FileHeader) - 32)
+#define FILE_HEADER_SIZE_PES18 sizeof(struct FileHeader)
+
+// Results of functions that can fail.
+#define CRYPT_OK                     0
+#define CRYPT_ERROR_IO              -1 // A file could not be read or written.
+#define CRYPT_ERROR_INVALID_SIZE    -2 // The sizes in the file header do not match the size of the input.
+#define CRYPT_ERROR_OUT_OF_MEMORY   -3
+#define CRYPT_ERROR_QUEUE_FULL      -4 // A worker pool cannot take more requests right now.
+#define CRYPT_ERROR_BLOCK_TOO_LARGE -5 // A block is larger than the maximum block size allowed.
+
+// Largest block accepted by the checked functions unless told otherwise.
+#define DEFAULT_MAX_BLOCK_SIZE (128u * 1024 * 1024)
+
+// Blocks following the file header, in file order.
+#define BLOCK_DESCRIPTION 0
+#define BLOCK_LOGO        1
+#define BLOCK_DATA        2
+#define BLOCK_SERIAL      3
+
+struct MasterKeyInfo;
+struct KeystreamCache;
+
 struct FileDescriptor
 {
     uint8_t *encryptionHeader;
@@ -76,13 +101,45 @@ struct FileDescriptor
 struct FileDescriptor CRYPTER_EXPORT *createFileDescriptor();
 void CRYPTER_EXPORT destroyFileDescriptor(struct FileDescriptor *desc);
 
+void CRYPTER_EXPORT decryptHeaderWithKeyInfo(struct FileHeader *header, const uint8_t *input, const struct MasterKeyInfo *masterKey);
+void CRYPTER_EXPORT decryptWithKeyInfo(struct FileDescriptor *descriptor, const uint8_t *input, const struct MasterKeyInfo *masterKey);
+int CRYPTER_EXPORT validateWithKeyInfo(struct FileHeader *header, const uint8_t *input, uint32_t size, const struct MasterKeyInfo *masterKey, uint32_t maxBlockSize);
+int CRYPTER_EXPORT decryptWithKeyInfoChecked(struct FileDescriptor *descriptor, const uint8_t *input, uint32_t size, const struct MasterKeyInfo *masterKey, uint32_t maxBlockSize);
+uint8_t CRYPTER_EXPORT *encryptWithKeyInfo(const struct FileDescriptor *descriptor, int *size, const struct MasterKeyInfo *masterKey);
+
+void CRYPTER_EXPORT cryptBlock(uint8_t *output, const uint8_t *input, uint32_t size, int block, const uint8_t *encryptionHeader);
+int CRYPTER_EXPORT decryptImage(uint8_t *output, const uint8_t *input, uint32_t size, const struct MasterKeyInfo *masterKey);
+int CRYPTER_EXPORT encryptImage(uint8_t *output, const uint8_t *input, uint32_t size, const struct MasterKeyInfo *masterKey);
+
+// Opt-in cache for the keystreams of files that are encrypted repeatedly with the same encryption header,
+// holding at most maxBytes. A cache must not be used by several threads at the same time.
+struct KeystreamCache CRYPTER_EXPORT *createKeystreamCache(size_t maxBytes);
+void CRYPTER_EXPORT clearKeystreamCache(struct KeystreamCache *cache);
+void CRYPTER_EXPORT destroyKeystreamCache(struct KeystreamCache *cache);
+uint8_t CRYPTER_EXPORT *encryptWithKeyInfoCached(const struct FileDescriptor *descriptor, int *size, const struct MasterKeyInfo *masterKey, struct KeystreamCache *cache);
+int CRYPTER_EXPORT encryptImageCached(uint8_t *output, const uint8_t *input, uint32_t size, const struct MasterKeyInfo *masterKey, struct KeystreamCache *cache);
+
+int CRYPTER_EXPORT decryptWithKeyInfo_ex(const char *pathIn, const char *pathOut, const struct MasterKeyInfo *masterKey);
+int CRYPTER_EXPORT encryptWithKeyInfoToFile(const struct FileDescriptor *descriptor, const char *path, const struct MasterKeyInfo *masterKey);
+
+int CRYPTER_EXPORT encryptWithKeyInfo_ex(const char *pathIn, const char *pathOut, const struct MasterKeyInfo *masterKey);
+
+void CRYPTER_EXPORT decryptHeaderWithKey(struct FileHeader *header, const uint8_t *input, const char *masterKey);
 void CRYPTER_EXPORT decryptWithKey(struct FileDescriptor *descriptor, const uint8_t *input, const char *masterKey);
+int CRYPTER_EXPORT decryptWithKeyChecked(struct FileDescriptor *descriptor, const uint8_t *input, uint32_t size, const char *masterKey, uint32_t maxBlockSize);
 uint8_t CRYPTER_EXPORT *encryptWithKey(const struct FileDescriptor *descriptor, int *size, const char *masterKey);
 
-void CRYPTER_EXPORT decryptWithKey_ex(const char *pathIn, const char *pathOut, const char *masterKey);
-void CRYPTER_EXPORT encryptWithKey_ex(const char *pathIn, const char *pathOut, const char *masterKey);
+int CRYPTER_EXPORT decryptWithKey_ex(const char *pathIn, const char *pathOut, const char *masterKey);
+int CRYPTER_EXPORT encryptWithKey_ex(const char *pathIn, const char *pathOut, const char *masterKey);
 
 uint8_t *readFile(const char *path, uint32_t *sizePtr);
+uint8_t *readFileDir(const char *dirName, const char *fileName, uint32_t *sizePtr);
+int readFileChecked(const char *path, const struct MasterKeyInfo *masterKey, struct FileHeader *header, uint8_t **data, uint32_t *sizePtr);
+int writeFile(const char *path, const uint8_t *data, int size);
+int writeFileDir(const char *dirName, const char *fileName, const uint8_t *data, int size);
+int replaceFile(const char *path, const uint8_t *data, uint32_t size);
+void copyFileType(char *output, const struct FileHeader *header);
+void reverseLongs(uint8_t *output, const uint8_t *input);
 
 // *** Old functions, maintained for backwards compability ***
 void CRYPTER_EXPORT decrypt(struct FileDescriptor *descriptor, const uint8_t *input);
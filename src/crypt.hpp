@@ -0,0 +1,262 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#ifndef _CRYPT_HPP
+#define _CRYPT_HPP
+
+// Header-only C++20 layer over the C library.
+// A SaveFile owns a single buffer holding the decrypted image of a file, i.e. the encryption header,
+// the file header and all blocks in file order, and hands out views into it. Decryption and encryption
+// work directly on caller-provided spans, so no intermediate buffers are needed.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string_view>
+
+#include "crypt.h"
+#include "masterkey.h"
+
+namespace pesx {
+
+enum class Error
+{
+    None           = CRYPT_OK,
+    Io             = CRYPT_ERROR_IO,
+    InvalidSize    = CRYPT_ERROR_INVALID_SIZE,
+    OutOfMemory    = CRYPT_ERROR_OUT_OF_MEMORY,
+    QueueFull      = CRYPT_ERROR_QUEUE_FULL,
+    BlockTooLarge  = CRYPT_ERROR_BLOCK_TOO_LARGE,
+};
+
+// Decrypt input into output, which must have the same size. Both may refer to the same memory.
+inline Error decrypt(std::span<const std::uint8_t> input, std::span<std::uint8_t> output, const MasterKeyInfo &masterKey)
+{
+    if (output.size() != input.size() || input.size() > UINT32_MAX)
+        return Error::InvalidSize;
+    return static_cast<Error>(decryptImage(output.data(), input.data(), static_cast<std::uint32_t>(input.size()), &masterKey));
+}
+
+// Encrypt a decrypted image into output, which must have the same size. Both may refer to the same memory.
+// An optional KeystreamCache speeds up encrypting the same file again.
+inline Error encrypt(std::span<const std::uint8_t> input, std::span<std::uint8_t> output, const MasterKeyInfo &masterKey,
+                     KeystreamCache *cache = nullptr)
+{
+    if (output.size() != input.size() || input.size() > UINT32_MAX)
+        return Error::InvalidSize;
+    return static_cast<Error>(encryptImageCached(output.data(), input.data(), static_cast<std::uint32_t>(input.size()), &masterKey, cache));
+}
+
+class SaveFile
+{
+public:
+    SaveFile() = default;
+    SaveFile(SaveFile &&) noexcept = default;
+    SaveFile &operator=(SaveFile &&) noexcept = default;
+    SaveFile(const SaveFile &) = delete;
+    SaveFile &operator=(const SaveFile &) = delete;
+
+    // Decrypt an encrypted file, writing the result straight into the buffer of the new SaveFile.
+    static Error decrypt(std::span<const std::uint8_t> input, const MasterKeyInfo &masterKey, SaveFile &result)
+    {
+        SaveFile file;
+        if (Error error = file.allocate(input.size(), masterKey); error != Error::None)
+            return error;
+        if (Error error = pesx::decrypt(input, file.bytes(), masterKey); error != Error::None)
+            return error;
+        result = std::move(file);
+        return Error::None;
+    }
+
+    // Decrypt an encrypted file of size bytes in place and take ownership of its buffer.
+    // On error, buffer is left to the caller, unchanged.
+    static Error decrypt(std::unique_ptr<std::uint8_t[]> &buffer, std::size_t size, const MasterKeyInfo &masterKey, SaveFile &result)
+    {
+        std::span<std::uint8_t> bytes(buffer.get(), buffer ? size : 0);
+        if (Error error = pesx::decrypt(bytes, bytes, masterKey); error != Error::None)
+            return error;
+        result.buffer_    = std::move(buffer);
+        result.size_      = size;
+        result.masterKey_ = &masterKey;
+        return Error::None;
+    }
+
+    // Assemble a new file from its parts. The block sizes in the file header are updated to match.
+    static Error create(const MasterKeyInfo &masterKey,
+                        std::span<const std::uint8_t> encryptionHeader, std::span<const std::uint8_t> fileHeader,
+                        std::span<const std::uint8_t> description,      std::span<const std::uint8_t> logo,
+                        std::span<const std::uint8_t> data,             std::span<const std::uint8_t> serial,
+                        SaveFile &result)
+    {
+        if (encryptionHeader.size() != ENCRYPTION_HEADER_SIZE || fileHeader.size() != masterKey.fileHeaderSize
+            || (serial.size() & 1) || description.size() > UINT32_MAX || logo.size() > UINT32_MAX
+            || data.size() > UINT32_MAX || serial.size() > UINT32_MAX)
+            return Error::InvalidSize;
+
+        std::size_t size = encryptionHeader.size() + fileHeader.size()
+                         + description.size() + logo.size() + data.size() + serial.size();
+        SaveFile file;
+        if (Error error = file.allocate(size, masterKey); error != Error::None)
+            return error;
+
+        std::uint8_t *output = file.buffer_.get();
+        for (std::span<const std::uint8_t> part : { encryptionHeader, fileHeader, description, logo, data, serial }) {
+            if (!part.empty())
+                std::memcpy(output, part.data(), part.size());
+            output += part.size();
+        }
+
+        FileHeader header = file.header();
+        header.descSize     = static_cast<std::uint32_t>(description.size());
+        header.logoSize     = static_cast<std::uint32_t>(logo.size());
+        header.dataSize     = static_cast<std::uint32_t>(data.size());
+        header.serialLength = static_cast<std::uint32_t>(serial.size() / 2);
+        std::memcpy(&file.buffer_[ENCRYPTION_HEADER_SIZE], &header, masterKey.fileHeaderSize);
+
+        result = std::move(file);
+        return Error::None;
+    }
+
+    // Encrypt the file into output, which must be size() bytes long.
+    Error encrypt(std::span<std::uint8_t> output, KeystreamCache *cache = nullptr) const
+    {
+        if (!masterKey_)
+            return Error::InvalidSize;
+        return pesx::encrypt(bytes(), output, *masterKey_, cache);
+    }
+
+    bool empty() const { return !buffer_; }
+    std::size_t size() const { return size_; }
+    const MasterKeyInfo *masterKey() const { return masterKey_; }
+
+    // The whole decrypted image.
+    std::span<std::uint8_t> bytes() { return { buffer_.get(), size_ }; }
+    std::span<const std::uint8_t> bytes() const { return { buffer_.get(), size_ }; }
+
+    // Copy of the file header; only the first masterKey()->fileHeaderSize bytes are meaningful.
+    // All zeroes for an empty SaveFile.
+    FileHeader header() const
+    {
+        FileHeader result{};
+        if (!empty())
+            std::memcpy(&result, &buffer_[ENCRYPTION_HEADER_SIZE], masterKey_->fileHeaderSize);
+        return result;
+    }
+
+    // Views of the parts of the file; all of them are empty for an empty SaveFile.
+    // The blocks are also empty while the block sizes in the file header do not match the size of the file.
+    std::span<std::uint8_t> encryptionHeader() { return bytes().subspan(0, empty() ? 0 : ENCRYPTION_HEADER_SIZE); }
+    std::span<std::uint8_t> fileHeader()       { return bytes().subspan(fileHeaderOffset(), fileHeaderSize()); }
+    std::span<std::uint8_t> description()      { return block(0); }
+    std::span<std::uint8_t> logo()             { return block(1); }
+    std::span<std::uint8_t> data()             { return block(2); }
+    std::span<std::uint8_t> serial()           { return block(3); }
+
+    std::span<const std::uint8_t> encryptionHeader() const { return bytes().subspan(0, empty() ? 0 : ENCRYPTION_HEADER_SIZE); }
+    std::span<const std::uint8_t> fileHeader() const       { return bytes().subspan(fileHeaderOffset(), fileHeaderSize()); }
+    std::span<const std::uint8_t> description() const      { return block(0); }
+    std::span<const std::uint8_t> logo() const             { return block(1); }
+    std::span<const std::uint8_t> data() const             { return block(2); }
+    std::span<const std::uint8_t> serial() const           { return block(3); }
+
+    // File type (EDIT, TEXPORT, SYSTEM etc.) and game version, without trailing zeroes.
+    std::string_view fileType() const { return headerString(offsetof(FileHeader, fileTypeString)); }
+    std::string_view gameVersion() const
+    {
+        if (fileHeaderSize() <= offsetof(FileHeader, gameVersionString))
+            return {};
+        return headerString(offsetof(FileHeader, gameVersionString));
+    }
+
+private:
+    Error allocate(std::size_t size, const MasterKeyInfo &masterKey)
+    {
+        buffer_.reset(new (std::nothrow) std::uint8_t[size]);
+        if (!buffer_)
+            return Error::OutOfMemory;
+        size_      = size;
+        masterKey_ = &masterKey;
+        return Error::None;
+    }
+
+    std::size_t fileHeaderOffset() const { return empty() ? 0 : ENCRYPTION_HEADER_SIZE; }
+    std::size_t fileHeaderSize() const   { return empty() ? 0 : masterKey_->fileHeaderSize; }
+
+    // Offset of a block in file order (description, logo, data, serial); its size is stored in size.
+    // The file header may have been changed through fileHeader() or bytes(), so its block sizes are checked
+    // like encrypt() does: unless they add up to the size of the buffer, all blocks are empty.
+    std::size_t blockOffset(int index, std::size_t &size) const
+    {
+        size = 0;
+        if (empty())
+            return 0;
+        FileHeader fileHeader = header();
+        std::uint64_t sizes[4] = { fileHeader.descSize, fileHeader.logoSize, fileHeader.dataSize, fileHeader.serialLength*2ull };
+        std::uint64_t offset = ENCRYPTION_HEADER_SIZE + masterKey_->fileHeaderSize;
+        if (offset + sizes[0] + sizes[1] + sizes[2] + sizes[3] != size_)
+            return 0;
+        for (int i = 0; i < index; ++i)
+            offset += sizes[i];
+        size = static_cast<std::size_t>(sizes[index]);
+        return static_cast<std::size_t>(offset);
+    }
+
+    std::span<std::uint8_t> block(int index)
+    {
+        std::size_t size;
+        std::size_t offset = blockOffset(index, size);
+        return bytes().subspan(offset, size);
+    }
+
+    std::span<const std::uint8_t> block(int index) const
+    {
+        std::size_t size;
+        std::size_t offset = blockOffset(index, size);
+        return bytes().subspan(offset, size);
+    }
+
+    std::string_view headerString(std::size_t offset) const
+    {
+        if (empty())
+            return {};
+        const char *string = reinterpret_cast<const char *>(&buffer_[ENCRYPTION_HEADER_SIZE + offset]);
+        std::size_t length = 0;
+        while (length < 32 && string[length])
+            ++length;
+        return { string, length };
+    }
+
+    std::unique_ptr<std::uint8_t[]> buffer_;
+    std::size_t size_ = 0;
+    const MasterKeyInfo *masterKey_ = nullptr;
+};
+
+} // namespace pesx
+
+#endif /* _CRYPT_HPP */
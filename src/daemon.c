@@ -0,0 +1,434 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "masterkey.h"
+#include "crypt.h"
+#include "workqueue.h"
+
+#define DEFAULT_THREAD_COUNT 4
+#define DEFAULT_QUEUE_DEPTH 64
+#define IDLE_TIMEOUT_SECONDS 30
+#define MAX_CONNECTIONS 1024
+#define MAX_REQUEST_LENGTH 65536
+
+// Requests are single lines of tab-separated fields:
+//   decrypt <input_file> <output_dir> [master_key_name]
+//   encrypt <input_dir> <output_file> [master_key_name]
+//   probe <input_file> [master_key_name]
+//   ping
+// Requests without a key name use the default key of the daemon. Every request is answered with a single line starting with either "OK" or "ERR".
+// A connection may send any number of requests before closing.
+//
+// Idle connections are watched by the main thread. Only once a connection has data to read, it is
+// handed to a worker, which serves all complete requests and then hands it back, so idle clients
+// never hold on to a worker.
+
+struct Connection
+{
+    int fd;
+    time_t lastActive;
+    char *buffer; // Start of a request that has not been received completely yet.
+    size_t length;
+    size_t capacity;
+    struct Connection *next;
+};
+
+static const struct MasterKeyInfo *defaultMasterKey;
+static volatile sig_atomic_t stopRequested;
+
+// Connections handed back by the workers, and a pipe to wake up the main thread when that happens.
+static pthread_mutex_t returnedLock = PTHREAD_MUTEX_INITIALIZER;
+static struct Connection *returnedConnections;
+static int wakeFds[2];
+
+
+static void sendLine(int fd, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (length < 0)
+        return;
+    if (length > (int)sizeof(line) - 2)
+        length = sizeof(line) - 2;
+    line[length++] = '\n';
+
+    for (int written = 0; written < length;) {
+        ssize_t result = write(fd, &line[written], length - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return;
+        written += result;
+    }
+}
+
+// Describe a CRYPT_ERROR_* result for the ERR line of a response.
+static const char *describeError(int result)
+{
+    switch (result) {
+    case CRYPT_ERROR_IO:              return "i/o error";
+    case CRYPT_ERROR_INVALID_SIZE:    return "invalid block sizes";
+    case CRYPT_ERROR_OUT_OF_MEMORY:   return "out of memory";
+    case CRYPT_ERROR_BLOCK_TOO_LARGE: return "block too large";
+    default:                          return "unknown error";
+    }
+}
+
+static void handleRequest(int fd, char *request)
+{
+    char *position;
+    char *command = strtok_r(request, "\t", &position);
+    char *first   = strtok_r(NULL, "\t", &position);
+    char *second  = strtok_r(NULL, "\t", &position);
+    char *third   = strtok_r(NULL, "\t", &position);
+    struct FileHeader header;
+    char fileType[sizeof(header.fileTypeString) + 1];
+    int result;
+
+    // The key name is always the last field.
+    const char *keyName = (command && !strcmp(command, "probe")) ? second : third;
+    const struct MasterKeyInfo *masterKey = keyName ? findMasterKey(keyName) : defaultMasterKey;
+
+    if (!command) {
+        sendLine(fd, "ERR empty request");
+    }
+    else if (!strcmp(command, "ping")) {
+        sendLine(fd, "OK");
+    }
+    else if (!masterKey) {
+        sendLine(fd, "ERR unknown master key");
+    }
+    else if (!strcmp(command, "probe") && first) {
+        if ((result = readFileChecked(first, masterKey, &header, NULL, NULL))) {
+            sendLine(fd, "ERR %s", describeError(result));
+        }
+        else {
+            copyFileType(fileType, &header);
+            sendLine(fd, "OK %s\t%u\t%u\t%u\t%u", fileType,
+                     header.descSize, header.logoSize, header.dataSize, header.serialLength);
+        }
+    }
+    else if (!strcmp(command, "decrypt") && first && second) {
+        if ((result = decryptWithKeyInfo_ex(first, second, masterKey)))
+            sendLine(fd, "ERR %s", describeError(result));
+        else
+            sendLine(fd, "OK");
+    }
+    else if (!strcmp(command, "encrypt") && first && second) {
+        if ((result = encryptWithKeyInfo_ex(first, second, masterKey)))
+            sendLine(fd, "ERR %s", describeError(result));
+        else
+            sendLine(fd, "OK");
+    }
+    else {
+        sendLine(fd, "ERR unknown request");
+    }
+}
+
+static void closeConnection(struct Connection *connection)
+{
+    close(connection->fd);
+    free(connection->buffer);
+    free(connection);
+}
+
+// Read what the client has sent so far and serve all complete requests; runs on a worker thread.
+// Returns 0 if the connection stays open, and -1 if it was closed or broke the protocol.
+static int serveConnection(struct Connection *connection)
+{
+    for (;;) {
+        if (connection->capacity - connection->length < 4096) {
+            if (connection->capacity >= MAX_REQUEST_LENGTH) {
+                sendLine(connection->fd, "ERR request too long");
+                return -1;
+            }
+            size_t capacity = connection->capacity ? connection->capacity*2 : 4096;
+            char *buffer = (char *)realloc(connection->buffer, capacity);
+            if (!buffer)
+                return -1;
+            connection->buffer = buffer;
+            connection->capacity = capacity;
+        }
+
+        ssize_t received = recv(connection->fd, &connection->buffer[connection->length],
+                                connection->capacity - connection->length - 1, MSG_DONTWAIT);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (received <= 0)
+            return -1;
+
+        connection->length += received;
+        connection->buffer[connection->length] = '\0';
+
+        char *request = connection->buffer, *end;
+        while ((end = strchr(request, '\n'))) {
+            *end = '\0';
+            if (end > request && end[-1] == '\r')
+                end[-1] = '\0';
+            handleRequest(connection->fd, request);
+            request = end + 1;
+        }
+        connection->length -= request - connection->buffer;
+        memmove(connection->buffer, request, connection->length);
+    }
+}
+
+static void handleConnection(void *argument)
+{
+    struct Connection *connection = (struct Connection *)argument;
+    if (serveConnection(connection)) {
+        closeConnection(connection);
+        return;
+    }
+
+    connection->lastActive = time(NULL);
+    pthread_mutex_lock(&returnedLock);
+    connection->next = returnedConnections;
+    returnedConnections = connection;
+    pthread_mutex_unlock(&returnedLock);
+
+    char wake = 0;
+    while (write(wakeFds[1], &wake, 1) < 0 && errno == EINTR);
+}
+
+static void requestStop(int signal)
+{
+    (void)signal;
+    stopRequested = 1;
+}
+
+static int listenOn(const char *path)
+{
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path too long!\n");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    // Remove a socket left over by a previous instance, but not one that another instance still listens on.
+    struct stat existing;
+    if (!stat(path, &existing) && S_ISSOCK(existing.st_mode)) {
+        if (!connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+            printf("Another daemon is already listening on %s\n", path);
+            close(fd);
+            return -1;
+        }
+        if (errno == ECONNREFUSED)
+            unlink(path);
+        close(fd);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) || listen(fd, SOMAXCONN)) {
+        printf("Unable to listen on %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void printUsage()
+{
+    printf("Usage: daemon [-j threads] [-q queue_depth] [socket_path] [[master_key_file|master_key_name] [game_version]]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int threadCount = DEFAULT_THREAD_COUNT;
+    int queueDepth  = DEFAULT_QUEUE_DEPTH;
+
+    int option;
+    while ((option = getopt(argc, argv, "j:q:")) != -1) {
+        switch (option) {
+        case 'j': threadCount = atoi(optarg); break;
+        case 'q': queueDepth  = atoi(optarg); break;
+        default:  printUsage(); return -1;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 3 || threadCount < 1 || queueDepth < 1) {
+        printUsage();
+        return -1;
+    }
+
+    // Keys are only loaded once, before any worker starts, and then shared by all requests.
+#ifdef PES_VERSION
+    defaultMasterKey = findMasterKey(PES_VERSION);
+#endif
+    if (argc - optind >= 2) {
+        int gameVersion = argc - optind == 3 ? atoi(argv[optind + 2])
+                        : defaultMasterKey ? defaultMasterKey->gameVersion : 0;
+        defaultMasterKey = findOrLoadMasterKey(argv[optind + 1], gameVersion);
+        if (!defaultMasterKey) {
+            printf("Invalid master key!\n");
+            return -1;
+        }
+    }
+
+    const char *socketPath = argv[optind];
+    int listenFd = listenOn(socketPath);
+    if (listenFd < 0)
+        return -1;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Both ends of the wake-up pipe are non-blocking: if it is full, the main thread is going to wake up anyway.
+    struct WorkQueue *queue = NULL;
+    if (!pipe(wakeFds)) {
+        fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+        queue = createWorkQueue(threadCount, queueDepth);
+    }
+    if (!queue) {
+        close(listenFd);
+        unlink(socketPath);
+        return -1;
+    }
+
+    // The first two entries are the listening socket and the wake-up pipe, followed by the idle connections.
+    static struct pollfd fds[MAX_CONNECTIONS + 2];
+    static struct Connection *idle[MAX_CONNECTIONS + 2];
+    int idleCount = 0;
+    fds[0].fd = listenFd;
+    fds[1].fd = wakeFds[0];
+
+    while (!stopRequested) {
+        for (int i = 0; i < idleCount + 2; ++i) {
+            if (i >= 2)
+                fds[i].fd = idle[i]->fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        // Stop accepting while at the connection limit; further clients wait in the listen backlog.
+        if (idleCount == MAX_CONNECTIONS)
+            fds[0].events = 0;
+
+        if (poll(fds, idleCount + 2, 1000) < 0 && errno != EINTR)
+            break;
+
+        // Connections with data go to the pool. Once its queue is full, submitting blocks until a worker is free.
+        time_t now = time(NULL);
+        for (int i = 2; i < idleCount + 2;) {
+            if (fds[i].revents || now - idle[i]->lastActive > IDLE_TIMEOUT_SECONDS) {
+                struct Connection *connection = idle[i];
+                if (!fds[i].revents || submitWork(queue, handleConnection, connection))
+                    closeConnection(connection);
+                fds[i] = fds[idleCount + 1];
+                idle[i] = idle[idleCount + 1];
+                --idleCount;
+            }
+            else {
+                ++i;
+            }
+        }
+
+        if (fds[1].revents) {
+            char wake[64];
+            while (read(wakeFds[0], wake, sizeof(wake)) > 0 || errno == EINTR);
+        }
+        pthread_mutex_lock(&returnedLock);
+        while (returnedConnections && idleCount < MAX_CONNECTIONS) {
+            idle[2 + idleCount++] = returnedConnections;
+            returnedConnections = returnedConnections->next;
+        }
+        pthread_mutex_unlock(&returnedLock);
+
+        if (fds[0].revents && idleCount < MAX_CONNECTIONS) {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd < 0 && errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+                break;
+            struct Connection *connection = fd < 0 ? NULL : (struct Connection *)calloc(1, sizeof(struct Connection));
+            if (connection) {
+                // Do not let a client that does not read its responses block a worker forever.
+                struct timeval timeout = { IDLE_TIMEOUT_SECONDS, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+                connection->fd = fd;
+                connection->lastActive = now;
+                idle[2 + idleCount++] = connection;
+            }
+            else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    close(listenFd);
+    unlink(socketPath);
+    destroyWorkQueue(queue);
+
+    // All workers are done now, so every connection is either idle or was handed back.
+    for (int i = 2; i < idleCount + 2; ++i)
+        closeConnection(idle[i]);
+    while (returnedConnections) {
+        struct Connection *connection = returnedConnections;
+        returnedConnections = connection->next;
+        closeConnection(connection);
+    }
+    close(wakeFds[0]);
+    close(wakeFds[1]);
+
+    return 0;
+}
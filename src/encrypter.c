@@ -26,6 +26,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 
 #include "masterkey.h"
@@ -34,22 +35,26 @@
 
 int main(int argc, const char *argv[])
 {
-    if (argc == 3) {
-        encrypt_ex(argv[1], argv[2]);
-    }
-    else if (argc == 4) {
-        uint32_t size;
-        uint8_t *key = readFile(argv[3], &size);
-        if (size != MASTER_KEY_LENGTH) {
-            printf("Invalid key size!\n");
+    // Binaries built for a specific game version default to its key; the universal one needs to be told.
+#ifdef PES_VERSION
+    const struct MasterKeyInfo *masterKey = findMasterKey(PES_VERSION);
+#else
+    const struct MasterKeyInfo *masterKey = NULL;
+#endif
+
+    if (argc >= 4 && argc <= 5) {
+        // The key may be given by name or as a file, which is used for the given or the default game version.
+        int gameVersion = argc == 5 ? atoi(argv[4]) : masterKey ? masterKey->gameVersion : 0;
+        masterKey = findOrLoadMasterKey(argv[3], gameVersion);
+        if (!masterKey) {
+            printf("Invalid master key!\n");
             return -1;
         }
-        encryptWithKey_ex(argv[1], argv[2], key);
     }
-    else {
-        printf("Usage: encrypter [input_dir] [output_file] [[master_key_file]]\n");
+    if (argc < 3 || argc > 5 || !masterKey) {
+        printf("Usage: encrypter [input_dir] [output_file] [[master_key_file|master_key_name] [game_version]]\n");
         return -1;
     }
-    
-    return 0;
+
+    return encryptWithKeyInfo_ex(argv[1], argv[2], masterKey) ? -1 : 0;
 }
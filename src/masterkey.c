@@ -25,6 +25,17 @@
     For more information, please refer to <http://unlicense.org>
  */
 
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #include "masterkey.h"
 
 // Empty master key for default usage.
@@ -125,33 +136,278 @@ CRYPTER_EXPORT const uint8_t MasterKeyPes21[] = {
 
 
 // Set global master key.
-// Maintained for backwards compability and default key for binaries.
-#ifdef USE_PES16_MASTER_KEY
-const uint8_t *MasterKey = MasterKeyPes16;
+// Maintained for backwards compability.
+const uint8_t *MasterKey = MasterKeyZero;
+
+
+// Built-in keys, added to the registry on first use.
+static const struct
+{
+    const char *name;
+    int gameVersion;
+    const uint8_t *key;
+} BuiltinKeys[] = {
+    { "16",       2016, MasterKeyPes16       },
+    { "16myClub", 2016, MasterKeyPes16MyClub },
+    { "17",       2017, MasterKeyPes17       },
+    { "18",       2018, MasterKeyPes18       },
+    { "19",       2019, MasterKeyPes19       },
+    { "20",       2020, MasterKeyPes20       },
+    { "21",       2021, MasterKeyPes21       },
+};
+
+// Entries are only ever appended and never changed afterwards, so pointers to them stay valid.
+// RegistryLock guards RegistrySize and the appending of entries.
+static struct MasterKeyInfo Registry[MAX_MASTER_KEYS];
+static int RegistrySize;
+
+// Key files loaded by findOrLoadMasterKey, so that every path is only read once per game version.
+// Guarded by RegistryLock as well.
+static struct
+{
+    char *path;
+    int gameVersion;
+    const struct MasterKeyInfo *info;
+} LoadedKeys[MAX_MASTER_KEYS];
+static int LoadedKeyCount;
+
+#ifdef _WIN32
+static INIT_ONCE RegistryOnce = INIT_ONCE_STATIC_INIT;
+static SRWLOCK RegistryLock = SRWLOCK_INIT;
+#else
+static pthread_once_t RegistryOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t RegistryLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int compareNames(const char *a, const char *b)
+{
+    for (; *a && *b; ++a, ++b)
+        if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+            break;
+    return tolower((unsigned char)*a) - tolower((unsigned char)*b);
+}
+
+static void addBuiltinKeys()
+{
+    for (size_t i = 0; i < sizeof(BuiltinKeys) / sizeof(BuiltinKeys[0]); ++i)
+        initMasterKeyInfo(&Registry[RegistrySize++], BuiltinKeys[i].name, BuiltinKeys[i].gameVersion, BuiltinKeys[i].key);
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK addBuiltinKeysOnce(PINIT_ONCE once, PVOID parameter, PVOID *context)
+{
+    (void)once; (void)parameter; (void)context;
+    addBuiltinKeys();
+    return TRUE;
+}
+#endif
+
+// Add the built-in keys on first use and take the registry lock.
+static void lockRegistry()
+{
+#ifdef _WIN32
+    InitOnceExecuteOnce(&RegistryOnce, addBuiltinKeysOnce, NULL, NULL);
+    AcquireSRWLockExclusive(&RegistryLock);
+#else
+    pthread_once(&RegistryOnce, addBuiltinKeys);
+    pthread_mutex_lock(&RegistryLock);
+#endif
+}
+
+static void unlockRegistry()
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&RegistryLock);
 #else
-	#if USE_PES16MYCLUB_MASTER_KEY
-	const uint8_t *MasterKey = MasterKeyPes16MyClub;
-	#else
-		#if USE_PES17_MASTER_KEY
-		const uint8_t *MasterKey = MasterKeyPes17;
-		#else
-			#if USE_PES18_MASTER_KEY
-			const uint8_t *MasterKey = MasterKeyPes18;
-			#else
-				#if USE_PES19_MASTER_KEY
-				const uint8_t *MasterKey = MasterKeyPes19;
-				#else
-					#if USE_PES20_MASTER_KEY
-					const uint8_t *MasterKey = MasterKeyPes20;
-					#else
-						#if USE_PES21_MASTER_KEY
-						const uint8_t *MasterKey = MasterKeyPes21;
-						#else
-						const uint8_t *MasterKey = MasterKeyZero;
-						#endif
-					#endif
-				#endif
-			#endif
-		#endif
-	#endif
+    pthread_mutex_unlock(&RegistryLock);
 #endif
+}
+
+// Find a key by name, ignoring case. Must be called with the registry locked.
+static const struct MasterKeyInfo *findLocked(const char *name)
+{
+    for (int i = 0; i < RegistrySize; ++i)
+        if (!compareNames(Registry[i].name, name))
+            return &Registry[i];
+    return NULL;
+}
+
+void CRYPTER_EXPORT initMasterKeyInfo(struct MasterKeyInfo *info, const char *name, int gameVersion, const uint8_t *key)
+{
+    memset(info, 0, sizeof(struct MasterKeyInfo));
+    strncpy(info->name, name, MASTER_KEY_NAME_LENGTH - 1);
+    info->gameVersion    = gameVersion;
+    info->fileHeaderSize = gameVersion >= 2018 ? FILE_HEADER_SIZE_PES18 : FILE_HEADER_SIZE_PES16;
+    memcpy(info->key, key, MASTER_KEY_LENGTH);
+    reverseLongs(info->shuffledKey, key);
+}
+
+int CRYPTER_EXPORT getMasterKeyCount()
+{
+    lockRegistry();
+    int result = RegistrySize;
+    unlockRegistry();
+    return result;
+}
+
+const struct MasterKeyInfo CRYPTER_EXPORT *getMasterKeyInfo(int index)
+{
+    lockRegistry();
+    const struct MasterKeyInfo *result = (index >= 0 && index < RegistrySize) ? &Registry[index] : NULL;
+    unlockRegistry();
+    return result;
+}
+
+// Find a key by name, ignoring case.
+const struct MasterKeyInfo CRYPTER_EXPORT *findMasterKey(const char *name)
+{
+    lockRegistry();
+    const struct MasterKeyInfo *result = findLocked(name);
+    unlockRegistry();
+    return result;
+}
+
+// Find the first key registered for the given game version.
+const struct MasterKeyInfo CRYPTER_EXPORT *findMasterKeyByVersion(int gameVersion)
+{
+    const struct MasterKeyInfo *result = NULL;
+    lockRegistry();
+    for (int i = 0; i < RegistrySize && !result; ++i)
+        if (Registry[i].gameVersion == gameVersion)
+            result = &Registry[i];
+    unlockRegistry();
+    return result;
+}
+
+// Find the first key with the given MASTER_KEY_LENGTH bytes.
+const struct MasterKeyInfo CRYPTER_EXPORT *findMasterKeyByData(const uint8_t *key)
+{
+    const struct MasterKeyInfo *result = NULL;
+    lockRegistry();
+    for (int i = 0; i < RegistrySize && !result; ++i)
+        if (!memcmp(Registry[i].key, key, MASTER_KEY_LENGTH))
+            result = &Registry[i];
+    unlockRegistry();
+    return result;
+}
+
+// Find the entry of key for gameVersion. Must be called with the registry locked.
+static const struct MasterKeyInfo *findKeyLocked(int gameVersion, const uint8_t *key)
+{
+    for (int i = 0; i < RegistrySize; ++i)
+        if (Registry[i].gameVersion == gameVersion && !memcmp(Registry[i].key, key, MASTER_KEY_LENGTH))
+            return &Registry[i];
+    return NULL;
+}
+
+// Append a key to the registry. Must be called with the registry locked.
+static const struct MasterKeyInfo *appendLocked(const char *name, int gameVersion, const uint8_t *key)
+{
+    if (RegistrySize >= MAX_MASTER_KEYS)
+        return NULL;
+    initMasterKeyInfo(&Registry[RegistrySize], name, gameVersion, key);
+    return &Registry[RegistrySize++];
+}
+
+// Add a key to the registry. If the same key is already registered for that game version, the existing entry is returned.
+// Returns NULL if the name does not fit into MASTER_KEY_NAME_LENGTH, is already taken by a different key, or the registry is full.
+const struct MasterKeyInfo CRYPTER_EXPORT *registerMasterKey(const char *name, int gameVersion, const uint8_t *key)
+{
+    lockRegistry();
+    const struct MasterKeyInfo *result = findKeyLocked(gameVersion, key);
+    if (!result && strlen(name) < MASTER_KEY_NAME_LENGTH && !findLocked(name))
+        result = appendLocked(name, gameVersion, key);
+    unlockRegistry();
+    return result;
+}
+
+// Read a MASTER_KEY_LENGTH byte key from the file at path and add it to the registry.
+const struct MasterKeyInfo CRYPTER_EXPORT *loadMasterKeyFile(const char *path, const char *name, int gameVersion)
+{
+    uint32_t size;
+    uint8_t *key = readFile(path, &size);
+    if (!key)
+        return NULL;
+
+    const struct MasterKeyInfo *result = NULL;
+    if (size == MASTER_KEY_LENGTH)
+        result = registerMasterKey(name, gameVersion, key);
+
+    free(key);
+    return result;
+}
+
+// Find a key file loaded before. Must be called with the registry locked.
+static const struct MasterKeyInfo *findLoadedLocked(const char *path, int gameVersion)
+{
+    for (int i = 0; i < LoadedKeyCount; ++i)
+        if (LoadedKeys[i].gameVersion == gameVersion && !strcmp(LoadedKeys[i].path, path))
+            return LoadedKeys[i].info;
+    return NULL;
+}
+
+// Look up the key called nameOrPath; if there is none, load it from the file at that path instead.
+// Every path is only read once per game version. A loaded key is registered under the file name without its directory,
+// or under that name followed by ~2, ~3, ... if it is already taken; if the same key is already registered for
+// that game version, the existing entry is returned instead.
+const struct MasterKeyInfo CRYPTER_EXPORT *findOrLoadMasterKey(const char *nameOrPath, int gameVersion)
+{
+    const struct MasterKeyInfo *result = findMasterKey(nameOrPath);
+    if (result)
+        return result;
+
+    lockRegistry();
+    result = findLoadedLocked(nameOrPath, gameVersion);
+    unlockRegistry();
+    if (result)
+        return result;
+
+    uint32_t size;
+    uint8_t *key = readFile(nameOrPath, &size);
+    if (!key)
+        return NULL;
+    if (size != MASTER_KEY_LENGTH) {
+        free(key);
+        return NULL;
+    }
+
+    const char *fileName = nameOrPath;
+    for (const char *c = nameOrPath; *c; ++c)
+        if (*c == '/' || *c == '\\')
+            fileName = c + 1;
+
+    lockRegistry();
+    // Another thread may have loaded the same file in the meantime.
+    result = findLoadedLocked(nameOrPath, gameVersion);
+    int loaded = result != NULL;
+    if (!result)
+        result = findKeyLocked(gameVersion, key);
+    if (!result) {
+        char name[MASTER_KEY_NAME_LENGTH];
+        snprintf(name, sizeof(name), "%s", fileName);
+        for (int suffix = 2; findLocked(name) && suffix <= MAX_MASTER_KEYS; ++suffix) {
+            char suffixString[8];
+            int suffixLength = snprintf(suffixString, sizeof(suffixString), "~%d", suffix);
+            int nameLength = (int)strlen(fileName);
+            if (nameLength > MASTER_KEY_NAME_LENGTH - 1 - suffixLength)
+                nameLength = MASTER_KEY_NAME_LENGTH - 1 - suffixLength;
+            snprintf(name, sizeof(name), "%.*s%s", nameLength, fileName, suffixString);
+        }
+        if (!findLocked(name))
+            result = appendLocked(name, gameVersion, key);
+    }
+    if (result && !loaded && LoadedKeyCount < MAX_MASTER_KEYS) {
+        char *path = (char *)malloc(strlen(nameOrPath) + 1);
+        if (path) {
+            strcpy(path, nameOrPath);
+            LoadedKeys[LoadedKeyCount].path = path;
+            LoadedKeys[LoadedKeyCount].gameVersion = gameVersion;
+            LoadedKeys[LoadedKeyCount].info = result;
+            ++LoadedKeyCount;
+        }
+    }
+    unlockRegistry();
+
+    free(key);
+    return result;
+}
@@ -33,10 +33,43 @@
 #include "crypt.h"
 
 #define MASTER_KEY_LENGTH 64
+#define MASTER_KEY_NAME_LENGTH 32
+#define MAX_MASTER_KEYS 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Master key prepared for use, as stored in the key registry.
+struct MasterKeyInfo
+{
+    char name[MASTER_KEY_NAME_LENGTH];
+    int gameVersion;                        // Release year, e.g. 2016 for PES 2016; 0 if unknown.
+    uint32_t fileHeaderSize;                // Size of the file header used by that game version.
+    uint8_t key[MASTER_KEY_LENGTH];
+    uint8_t shuffledKey[MASTER_KEY_LENGTH]; // Key with the byte order of each long reversed.
+};
+
+// Registry of all known master keys.
+// It contains the built-in keys below, named after the game versions of the binaries ("16", "16myClub", "17", ...),
+// as well as all keys registered at runtime. The registry may be queried and extended from any thread;
+// registered entries are never changed or removed, so the returned pointers stay valid.
+int CRYPTER_EXPORT getMasterKeyCount();
+const struct MasterKeyInfo CRYPTER_EXPORT *getMasterKeyInfo(int index);
+const struct MasterKeyInfo CRYPTER_EXPORT *findMasterKey(const char *name);
+const struct MasterKeyInfo CRYPTER_EXPORT *findMasterKeyByVersion(int gameVersion);
+const struct MasterKeyInfo CRYPTER_EXPORT *findMasterKeyByData(const uint8_t *key);
+
+const struct MasterKeyInfo CRYPTER_EXPORT *registerMasterKey(const char *name, int gameVersion, const uint8_t *key);
+const struct MasterKeyInfo CRYPTER_EXPORT *loadMasterKeyFile(const char *path, const char *name, int gameVersion);
+const struct MasterKeyInfo CRYPTER_EXPORT *findOrLoadMasterKey(const char *nameOrPath, int gameVersion);
+
+// Prepare a key for use without adding it to the registry.
+void CRYPTER_EXPORT initMasterKeyInfo(struct MasterKeyInfo *info, const char *name, int gameVersion, const uint8_t *key);
 
 
 // Empty master key for default usage.
-const uint8_t MasterKeyZero[MASTER_KEY_LENGTH];
+extern const uint8_t MasterKeyZero[MASTER_KEY_LENGTH];
 
 // Expose master keys for library usage.
 CRYPTER_EXPORT extern const uint8_t MasterKeyPes16[MASTER_KEY_LENGTH];
@@ -45,8 +78,14 @@ CRYPTER_EXPORT extern const uint8_t MasterKeyPes17[MASTER_KEY_LENGTH];
 CRYPTER_EXPORT extern const uint8_t MasterKeyPes18[MASTER_KEY_LENGTH];
 CRYPTER_EXPORT extern const uint8_t MasterKeyPes19[MASTER_KEY_LENGTH];
 CRYPTER_EXPORT extern const uint8_t MasterKeyPes20[MASTER_KEY_LENGTH];
+CRYPTER_EXPORT extern const uint8_t MasterKeyPes21[MASTER_KEY_LENGTH];
 
 // Old global master key, maintained for backwards compability.
+// This is always MasterKeyZero; the binaries look up their keys in the registry instead.
 extern uint8_t const *MasterKey;
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _MASTERKEY_H */
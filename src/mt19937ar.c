@@ -44,18 +44,22 @@
 #include "mt19937ar.h"
 
 /* Period parameters */  
-#define N 624
+#define N MT19937AR_N
 #define M 397
 #define MATRIX_A 0x9908b0dfUL   /* constant vector a */
 #define UPPER_MASK 0x80000000UL /* most significant w-r bits */
 #define LOWER_MASK 0x7fffffffUL /* least significant r bits */
 
-static uint32_t mt[N]; /* the array for the state vector  */
-static int mti=N+1; /* mti==N+1 means mt[N] is not initialized */
+/* the global state used by the non-reentrant functions */
+/* mti==N+1 means mt[N] is not initialized */
+static struct mt19937ar global_state = { {0}, N+1 };
 
 /* initializes mt[N] with a seed */
-void init_genrand(uint32_t s)
+static void init_genrand_r(struct mt19937ar *state, uint32_t s)
 {
+    uint32_t *mt = state->mt;
+    int mti;
+
     mt[0]= s & 0xffffffffUL;
     for (mti=1; mti<N; mti++) {
         mt[mti] = 
@@ -67,16 +71,18 @@ void init_genrand(uint32_t s)
         mt[mti] &= 0xffffffffUL;
         /* for >32 bit machines */
     }
+    state->mti = mti;
 }
 
 /* initialize by an array with array-length */
 /* init_key is the array for initializing keys */
 /* key_length is its length */
 /* slight change for C++, 2004/2/26 */
-void init_by_array(uint32_t init_key[], int key_length)
+void init_by_array_r(struct mt19937ar *state, uint32_t init_key[], int key_length)
 {
+    uint32_t *mt = state->mt;
     int i, j, k;
-    init_genrand(19650218UL);
+    init_genrand_r(state, 19650218UL);
     i=1; j=0;
     k = (N>key_length ? N : key_length);
     for (; k; k--) {
@@ -99,17 +105,18 @@ void init_by_array(uint32_t init_key[], int key_length)
 }
 
 /* generates a random number on [0,0xffffffff]-interval */
-uint32_t genrand_int32(void)
+uint32_t genrand_int32_r(struct mt19937ar *state)
 {
+    uint32_t *mt = state->mt;
     uint32_t y;
-    static uint32_t mag01[2]={0x0UL, MATRIX_A};
+    static const uint32_t mag01[2]={0x0UL, MATRIX_A};
     /* mag01[x] = x * MATRIX_A  for x=0,1 */
 
-    if (mti >= N) { /* generate N words at one time */
+    if (state->mti >= N) { /* generate N words at one time */
         int kk;
 
-        if (mti == N+1)   /* if init_genrand() has not been called, */
-            init_genrand(5489UL); /* a default initial seed is used */
+        if (state->mti == N+1)   /* if init_genrand() has not been called, */
+            init_genrand_r(state, 5489UL); /* a default initial seed is used */
 
         for (kk=0;kk<N-M;kk++) {
             y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
@@ -122,10 +129,10 @@ uint32_t genrand_int32(void)
         y = (mt[N-1]&UPPER_MASK)|(mt[0]&LOWER_MASK);
         mt[N-1] = mt[M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
 
-        mti = 0;
+        state->mti = 0;
     }
   
-    y = mt[mti++];
+    y = mt[state->mti++];
 
     /* Tempering */
     y ^= (y >> 11);
@@ -135,3 +142,13 @@ uint32_t genrand_int32(void)
 
     return y;
 }
+
+void init_by_array(uint32_t init_key[], int key_length)
+{
+    init_by_array_r(&global_state, init_key, key_length);
+}
+
+uint32_t genrand_int32(void)
+{
+    return genrand_int32_r(&global_state);
+}
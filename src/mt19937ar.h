@@ -3,7 +3,19 @@
 
 #include <stdint.h>
 
+#define MT19937AR_N 624
+
+/* generator state, so that several streams can be used concurrently */
+struct mt19937ar
+{
+    uint32_t mt[MT19937AR_N];
+    int mti;
+};
+
+void init_by_array_r(struct mt19937ar *state, uint32_t init_key[], int key_length);
+uint32_t genrand_int32_r(struct mt19937ar *state);
+
 void init_by_array(uint32_t init_key[], int key_length);
 uint32_t genrand_int32();
 
-#endif
\ No newline at end of file
+#endif
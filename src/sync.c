@@ -0,0 +1,593 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // For st_mtimespec.
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "masterkey.h"
+#include "crypt.h"
+
+// Keeps a directory of decrypted saves (the mirror) in sync with a directory of encrypted saves.
+// For every save, the mirror contains a directory of the same name holding the decrypted files.
+// A small state file in the mirror records size, modification time and content hash of every save and
+// every mirrored file, so that only saves and mirror blocks that actually changed are processed.
+// If both a save and its mirror were changed since the last run, neither is touched and the conflict is
+// reported; removing the mirror directory then restores it from the save.
+
+#define STATE_FILE_NAME ".pesxsync"
+#define STATE_FILE_VERSION 1
+#define MIRROR_FILE_COUNT 6
+#define WATCH_DELAY_MS 250
+
+// Files of a mirrored save, in the order of the FileDescriptor.
+enum
+{
+    MIRROR_ENCRYPTION_HEADER,
+    MIRROR_FILE_HEADER,
+    MIRROR_DESCRIPTION,
+    MIRROR_LOGO,
+    MIRROR_DATA,
+    MIRROR_SERIAL,
+};
+
+static const char *MirrorFileNames[MIRROR_FILE_COUNT] = {
+    "encryptHeader.dat", "header.dat", "description.dat", "logo.png", "data.dat", "version.txt",
+};
+
+struct FileState
+{
+    uint64_t size;
+    int64_t mtime;      // Nanoseconds.
+    uint64_t hash;
+};
+
+struct SyncEntry
+{
+    char name[256];
+    int valid;          // Whether the save could be decrypted at all.
+    struct FileState save;
+    struct FileState mirror[MIRROR_FILE_COUNT];
+    int seen;
+};
+
+struct SyncState
+{
+    struct SyncEntry *entries;
+    int count;
+    int capacity;
+};
+
+struct SyncStats
+{
+    int decrypted;
+    int encrypted;
+    int patchedBlocks;
+    int conflicts;
+    int failed;
+};
+
+
+// 64 bit FNV-1a.
+static uint64_t hashData(const uint8_t *data, uint64_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (uint64_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static char *joinPath(const char *dirName, const char *fileName)
+{
+    char *path = (char *)malloc(strlen(dirName) + strlen(fileName) + 2);
+    sprintf(path, "%s/%s", dirName, fileName);
+    return path;
+}
+
+// Fill in size and modification time of the file at path; the hash is left alone.
+static int statFile(const char *path, struct FileState *state)
+{
+    struct stat file;
+    if (stat(path, &file) || !S_ISREG(file.st_mode))
+        return -1;
+    state->size  = file.st_size;
+#ifdef __APPLE__
+    state->mtime = (int64_t)file.st_mtimespec.tv_sec * 1000000000 + file.st_mtimespec.tv_nsec;
+#else
+    state->mtime = (int64_t)file.st_mtim.tv_sec * 1000000000 + file.st_mtim.tv_nsec;
+#endif
+    return 0;
+}
+
+static int isUnchanged(const struct FileState *current, const struct FileState *recorded)
+{
+    return current->size == recorded->size && current->mtime == recorded->mtime;
+}
+
+static struct SyncEntry *findEntry(struct SyncState *state, const char *name)
+{
+    for (int i = 0; i < state->count; ++i)
+        if (!strcmp(state->entries[i].name, name))
+            return &state->entries[i];
+    return NULL;
+}
+
+static struct SyncEntry *addEntry(struct SyncState *state, const char *name)
+{
+    if (state->count == state->capacity) {
+        int capacity = state->capacity ? state->capacity * 2 : 64;
+        struct SyncEntry *entries = (struct SyncEntry *)realloc(state->entries, capacity * sizeof(struct SyncEntry));
+        if (!entries)
+            return NULL;
+        state->entries  = entries;
+        state->capacity = capacity;
+    }
+
+    struct SyncEntry *entry = &state->entries[state->count++];
+    memset(entry, 0, sizeof(struct SyncEntry));
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    return entry;
+}
+
+static void readFileState(char **cursor, struct FileState *state)
+{
+    state->size  = strtoull(*cursor, cursor, 10);
+    state->mtime = strtoll(*cursor, cursor, 10);
+    state->hash  = strtoull(*cursor, cursor, 16);
+}
+
+// The state file holds one line per save: its name, whether it is valid, and the state of the save
+// and of all its mirror files.
+static void loadState(const char *mirrorDir, struct SyncState *state)
+{
+    char *path = joinPath(mirrorDir, STATE_FILE_NAME);
+    FILE *stream = fopen(path, "r");
+    free(path);
+    if (!stream)
+        return;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    int version = 0;
+    if (getline(&line, &capacity, stream) > 0)
+        sscanf(line, "pesxsync %d", &version);
+
+    while (version == STATE_FILE_VERSION && getline(&line, &capacity, stream) > 0) {
+        char *cursor = strchr(line, '\t');
+        if (!cursor)
+            continue;
+        *cursor++ = '\0';
+
+        struct SyncEntry *entry = addEntry(state, line);
+        if (!entry)
+            break;
+        entry->valid = strtol(cursor, &cursor, 10);
+        readFileState(&cursor, &entry->save);
+        for (int i = 0; i < MIRROR_FILE_COUNT; ++i)
+            readFileState(&cursor, &entry->mirror[i]);
+    }
+
+    free(line);
+    fclose(stream);
+}
+
+// Write the state to a temporary file first, so an interrupted run never leaves a broken state behind.
+static int saveState(const char *mirrorDir, const struct SyncState *state)
+{
+    char *path = joinPath(mirrorDir, STATE_FILE_NAME);
+    char *temporaryPath = joinPath(mirrorDir, STATE_FILE_NAME ".tmp");
+
+    int result = -1;
+    FILE *stream = fopen(temporaryPath, "w");
+    if (stream) {
+        fprintf(stream, "pesxsync %d\n", STATE_FILE_VERSION);
+        for (int i = 0; i < state->count; ++i) {
+            const struct SyncEntry *entry = &state->entries[i];
+            if (!entry->seen)
+                continue;
+            fprintf(stream, "%s\t%d", entry->name, entry->valid);
+            for (int j = -1; j < MIRROR_FILE_COUNT; ++j) {
+                const struct FileState *file = j < 0 ? &entry->save : &entry->mirror[j];
+                fprintf(stream, "\t%llu\t%lld\t%016llx", (unsigned long long)file->size,
+                        (long long)file->mtime, (unsigned long long)file->hash);
+            }
+            fprintf(stream, "\n");
+        }
+        if (!fclose(stream) && !rename(temporaryPath, path))
+            result = 0;
+    }
+
+    free(temporaryPath);
+    free(path);
+    return result;
+}
+
+// Record the current state of the save and all mirror files of entry.
+static int recordEntry(struct SyncEntry *entry, const char *savePath, const char *mirrorPath)
+{
+    uint32_t size;
+    uint8_t *data = readFile(savePath, &size);
+    if (!data || statFile(savePath, &entry->save)) {
+        free(data);
+        return -1;
+    }
+    entry->save.hash = hashData(data, size);
+    free(data);
+
+    for (int i = 0; i < MIRROR_FILE_COUNT; ++i) {
+        char *path = joinPath(mirrorPath, MirrorFileNames[i]);
+        data = readFile(path, &size);
+        int result = (data && !statFile(path, &entry->mirror[i])) ? 0 : -1;
+        if (data)
+            entry->mirror[i].hash = hashData(data, size);
+        free(data);
+        free(path);
+        if (result)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Decrypt the save into its mirror directory.
+static int decryptToMirror(struct SyncEntry *entry, uint8_t *save, uint32_t size,
+                           const char *savePath, const char *mirrorPath, const struct MasterKeyInfo *masterKey)
+{
+    uint64_t saveHash = hashData(save, size);
+
+    entry->save.hash = saveHash;
+    if (statFile(savePath, &entry->save))
+        return -1;
+
+    // Decrypt in place; the image holds all mirror files back to back.
+    // Files that are not saves are remembered as such, so they are not looked at again until they change.
+    entry->valid = !decryptImage(save, save, size, masterKey);
+    if (!entry->valid) {
+        memset(entry->mirror, 0, sizeof(entry->mirror));
+        return 0;
+    }
+
+    const struct FileHeader *header = (const struct FileHeader *)&save[ENCRYPTION_HEADER_SIZE];
+    uint32_t sizes[MIRROR_FILE_COUNT] = {
+        ENCRYPTION_HEADER_SIZE, masterKey->fileHeaderSize,
+        header->descSize, header->logoSize, header->dataSize, header->serialLength*2,
+    };
+
+    uint32_t offset = 0;
+    for (int i = 0; i < MIRROR_FILE_COUNT; ++i) {
+        if (writeFileDir(mirrorPath, MirrorFileNames[i], &save[offset], sizes[i]))
+            return -1;
+        entry->mirror[i].hash = hashData(&save[offset], sizes[i]);
+        char *path = joinPath(mirrorPath, MirrorFileNames[i]);
+        int result = statFile(path, &entry->mirror[i]);
+        free(path);
+        if (result)
+            return -1;
+        offset += sizes[i];
+    }
+
+    return 0;
+}
+
+// Whether the mirror holds exactly the decrypted save, e.g. because the save was encrypted from it
+// but the run was interrupted before the state was written. Decrypts the save in place.
+static int mirrorMatchesSave(uint8_t *save, uint32_t size, const char *mirrorPath, const struct MasterKeyInfo *masterKey)
+{
+    if (decryptImage(save, save, size, masterKey))
+        return 0;
+
+    uint32_t offset = 0;
+    int matches = 1;
+    for (int i = 0; i < MIRROR_FILE_COUNT && matches; ++i) {
+        uint32_t mirrorSize;
+        uint8_t *data = readFileDir(mirrorPath, MirrorFileNames[i], &mirrorSize);
+        matches = data && mirrorSize <= size - offset && !memcmp(data, &save[offset], mirrorSize);
+        offset += mirrorSize;
+        free(data);
+    }
+    return matches && offset == size;
+}
+
+// Bring the save up to date with its mirror. If only blocks changed and kept their size, just
+// those blocks are encrypted into the save; otherwise the whole save is encrypted again.
+// Either way, the save is replaced as a whole, so it is never left half-written.
+static int encryptFromMirror(struct SyncEntry *entry, const int *changed, const char *savePath,
+                             const char *mirrorPath, const struct MasterKeyInfo *masterKey, struct SyncStats *stats)
+{
+    int patch = !changed[MIRROR_ENCRYPTION_HEADER] && !changed[MIRROR_FILE_HEADER];
+    for (int i = MIRROR_DESCRIPTION; i < MIRROR_FILE_COUNT && patch; ++i) {
+        struct FileState current;
+        char *path = joinPath(mirrorPath, MirrorFileNames[i]);
+        if (changed[i] && (statFile(path, &current) || current.size != entry->mirror[i].size))
+            patch = 0;
+        free(path);
+    }
+
+    if (!patch) {
+        if (encryptWithKeyInfo_ex(mirrorPath, savePath, masterKey))
+            return -1;
+        ++stats->encrypted;
+
+        // The encrypter takes the block sizes from the mirror files, so bring the mirrored header up to date.
+        uint32_t size;
+        uint8_t *save = readFile(savePath, &size);
+        if (!save || size < ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize) {
+            free(save);
+            return -1;
+        }
+        struct FileHeader header;
+        decryptHeaderWithKeyInfo(&header, save, masterKey);
+        int result = writeFileDir(mirrorPath, MirrorFileNames[MIRROR_FILE_HEADER], (uint8_t *)&header, masterKey->fileHeaderSize);
+        free(save);
+        if (result)
+            return -1;
+
+        return recordEntry(entry, savePath, mirrorPath);
+    }
+
+    uint32_t saveSize;
+    uint8_t *save = readFile(savePath, &saveSize);
+    uint8_t *encryptionHeader = readFileDir(mirrorPath, MirrorFileNames[MIRROR_ENCRYPTION_HEADER], NULL);
+    int result = (save && encryptionHeader && saveSize == entry->save.size) ? 0 : -1;
+
+    int patchedBlocks = 0;
+    uint64_t offset = 0;
+    for (int i = 0; i < MIRROR_FILE_COUNT && !result; ++i) {
+        if (i >= MIRROR_DESCRIPTION && changed[i]) {
+            uint32_t size;
+            uint8_t *block = readFileDir(mirrorPath, MirrorFileNames[i], &size);
+            if (block && size == entry->mirror[i].size && offset + size <= saveSize) {
+                cryptBlock(&save[offset], block, size, i - MIRROR_DESCRIPTION, encryptionHeader);
+                ++patchedBlocks;
+            }
+            else {
+                result = -1;
+            }
+            free(block);
+        }
+        offset += entry->mirror[i].size;
+    }
+
+    if (!result && replaceFile(savePath, save, saveSize))
+        result = -1;
+    free(encryptionHeader);
+    free(save);
+    if (result)
+        return result;
+
+    stats->patchedBlocks += patchedBlocks;
+    return recordEntry(entry, savePath, mirrorPath);
+}
+
+static void syncEntry(const char *name, const char *saveDir, const char *mirrorDir,
+                      const struct MasterKeyInfo *masterKey, struct SyncState *state, struct SyncStats *stats)
+{
+    char *savePath = joinPath(saveDir, name);
+    char *mirrorPath = joinPath(mirrorDir, name);
+    struct SyncEntry *entry = findEntry(state, name);
+    struct FileState current;
+    int result = 0;
+
+    if (statFile(savePath, &current))
+        goto done;
+    if (!entry && !(entry = addEntry(state, name)))
+        goto done;
+    entry->seen = 1;
+
+    // Find mirror files that were edited since the last run. A mirror that went missing is restored from the save.
+    int mirrorMissing = 0, changed[MIRROR_FILE_COUNT], anyChanged = 0;
+    for (int i = 0; i < MIRROR_FILE_COUNT; ++i) {
+        struct FileState mirror;
+        char *path = joinPath(mirrorPath, MirrorFileNames[i]);
+        changed[i] = 0;
+        if (statFile(path, &mirror)) {
+            mirrorMissing = 1;
+        }
+        else if (entry->valid && !isUnchanged(&mirror, &entry->mirror[i])) {
+            uint32_t size;
+            uint8_t *data = readFile(path, &size);
+            changed[i] = !data || size != entry->mirror[i].size || hashData(data, size) != entry->mirror[i].hash;
+            if (!changed[i])
+                entry->mirror[i].mtime = mirror.mtime;
+            free(data);
+        }
+        anyChanged |= changed[i];
+        free(path);
+    }
+
+    // Check whether the content of a save that was written changed.
+    int saveChanged = 0;
+    if (!isUnchanged(&current, &entry->save) || (entry->valid && mirrorMissing)) {
+        uint32_t size;
+        uint8_t *save = readFile(savePath, &size);
+        if (!save) {
+            result = -1;
+        }
+        else if (!mirrorMissing && entry->save.size == size && hashData(save, size) == entry->save.hash) {
+            entry->save.mtime = current.mtime;
+        }
+        else if (anyChanged && !mirrorMissing) {
+            // Both sides were edited. Unless they agree, keep both as they are until the user decides.
+            if (mirrorMatchesSave(save, size, mirrorPath, masterKey)) {
+                result = recordEntry(entry, savePath, mirrorPath);
+            }
+            else {
+                printf("Conflict: %s and its mirror were both changed\n", name);
+                ++stats->conflicts;
+            }
+            saveChanged = 1;
+        }
+        else {
+            result = decryptToMirror(entry, save, size, savePath, mirrorPath, masterKey);
+            if (!result && entry->valid)
+                ++stats->decrypted;
+            saveChanged = 1;
+        }
+        free(save);
+    }
+
+    if (!result && !saveChanged && entry->valid && anyChanged && !mirrorMissing)
+        result = encryptFromMirror(entry, changed, savePath, mirrorPath, masterKey, stats);
+
+done:
+    if (result) {
+        printf("Unable to sync %s\n", name);
+        ++stats->failed;
+    }
+    free(mirrorPath);
+    free(savePath);
+}
+
+static int syncOnce(const char *saveDir, const char *mirrorDir, const struct MasterKeyInfo *masterKey, struct SyncState *state)
+{
+    DIR *dir = opendir(saveDir);
+    if (!dir) {
+        printf("Unable to open %s\n", saveDir);
+        return -1;
+    }
+
+    for (int i = 0; i < state->count; ++i)
+        state->entries[i].seen = 0;
+
+    struct SyncStats stats = { 0, 0, 0, 0, 0 };
+    struct dirent *file;
+    while ((file = readdir(dir))) {
+        // Skip hidden files and names that do not fit into the state file.
+        if (file->d_name[0] == '.' || strpbrk(file->d_name, "\t\n"))
+            continue;
+        syncEntry(file->d_name, saveDir, mirrorDir, masterKey, state, &stats);
+    }
+    closedir(dir);
+
+    // Forget saves that were removed.
+    int count = 0;
+    for (int i = 0; i < state->count; ++i)
+        if (state->entries[i].seen)
+            state->entries[count++] = state->entries[i];
+    state->count = count;
+
+    if (stats.decrypted || stats.encrypted || stats.patchedBlocks || stats.conflicts || stats.failed)
+        printf("Decrypted %d, encrypted %d, patched %d blocks, conflicts %d, failed %d\n",
+               stats.decrypted, stats.encrypted, stats.patchedBlocks, stats.conflicts, stats.failed);
+
+    if (saveState(mirrorDir, state)) {
+        printf("Unable to write state file\n");
+        return -1;
+    }
+    return (stats.failed || stats.conflicts) ? -1 : 0;
+}
+
+#ifdef __linux__
+// Watch the save directory and all mirror directories, syncing again whenever something changed.
+static int watch(const char *saveDir, const char *mirrorDir, const struct MasterKeyInfo *masterKey, struct SyncState *state)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE;
+    for (;;) {
+        if (inotify_add_watch(fd, saveDir, mask) < 0) {
+            close(fd);
+            return -1;
+        }
+        for (int i = 0; i < state->count; ++i) {
+            char *path = joinPath(mirrorDir, state->entries[i].name);
+            inotify_add_watch(fd, path, mask);
+            free(path);
+        }
+
+        // Wait for a change, then for things to settle down, as saves are usually written in several steps.
+        char buffer[4096];
+        struct pollfd events = { fd, POLLIN, 0 };
+        if (poll(&events, 1, -1) < 0 && errno != EINTR)
+            break;
+        do {
+            if (read(fd, buffer, sizeof(buffer)) < 0 && errno != EINTR)
+                break;
+        } while (poll(&events, 1, WATCH_DELAY_MS) > 0);
+
+        syncOnce(saveDir, mirrorDir, masterKey, state);
+    }
+
+    close(fd);
+    return -1;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    int watchMode = argc > 1 && !strcmp(argv[1], "-w");
+    argv += watchMode;
+    argc -= watchMode;
+
+    if (argc < 4 || argc > 5) {
+        printf("Usage: pesXsync [-w] [save_dir] [mirror_dir] [master_key_file|master_key_name] [[game_version]]\n");
+        return -1;
+    }
+
+    const struct MasterKeyInfo *masterKey = findOrLoadMasterKey(argv[3], argc == 5 ? atoi(argv[4]) : 0);
+    if (!masterKey) {
+        printf("Invalid master key!\n");
+        return -1;
+    }
+
+    const char *saveDir = argv[1], *mirrorDir = argv[2];
+    mkdir(mirrorDir, 0777);
+
+    struct SyncState state = { NULL, 0, 0 };
+    loadState(mirrorDir, &state);
+
+    int result = syncOnce(saveDir, mirrorDir, masterKey, &state);
+    if (watchMode) {
+#ifdef __linux__
+        result = watch(saveDir, mirrorDir, masterKey, &state);
+#else
+        printf("Watching is only supported on Linux\n");
+        result = -1;
+#endif
+    }
+
+    free(state.entries);
+    return result;
+}
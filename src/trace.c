@@ -0,0 +1,236 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Every thread collects its events in a buffer of its own, which is only written to the trace file once it holds
+// TRACE_FLUSH_SIZE bytes, when the thread exits, or when the process exits. So workers do not wait for each other.
+#define TRACE_FLUSH_SIZE (64*1024)
+
+// Upper bound on the length of an event besides its name and file.
+#define TRACE_EVENT_SIZE 256
+
+struct TraceBuffer
+{
+    struct TraceBuffer *next;
+    int thread;
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Events are written in the JSON array format, which does not require the closing bracket.
+// So a trace is still readable if the process is killed, except for the events that were not flushed yet.
+static pthread_once_t TraceOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t TraceBufferKey;
+static FILE *TraceStream = NULL;
+static int TraceEnabled = 0;
+static int TraceProcess = 0;
+static int TraceBatchCount = 0;
+static int TraceThreadCount = 0;
+static struct TraceBuffer *TraceBuffers = NULL;
+static __thread struct TraceBuffer *TraceThreadBuffer = NULL;
+
+// Write the events of buffer to the trace file. TraceLock must be held.
+static void flushLocked(struct TraceBuffer *buffer)
+{
+    if (TraceStream && buffer->length) {
+        if (TraceBatchCount++)
+            fputs(",\n", TraceStream);
+        fwrite(buffer->data, 1, buffer->length, TraceStream);
+    }
+    buffer->length = 0;
+}
+
+// Called when a thread exits.
+static void releaseBuffer(void *data)
+{
+    struct TraceBuffer *buffer = (struct TraceBuffer *)data;
+
+    pthread_mutex_lock(&TraceLock);
+    flushLocked(buffer);
+    struct TraceBuffer **link = &TraceBuffers;
+    while (*link != buffer)
+        link = &(*link)->next;
+    *link = buffer->next;
+    pthread_mutex_unlock(&TraceLock);
+
+    free(buffer->data);
+    free(buffer);
+    TraceThreadBuffer = NULL;
+}
+
+// Flush the buffers of all threads and close the trace file. Threads that are still running afterwards
+// keep collecting events, which are dropped.
+static void closeTrace()
+{
+    pthread_mutex_lock(&TraceLock);
+    for (struct TraceBuffer *buffer = TraceBuffers; buffer; buffer = buffer->next)
+        flushLocked(buffer);
+    if (TraceStream) {
+        fputs("\n]\n", TraceStream);
+        fclose(TraceStream);
+        TraceStream = NULL;
+    }
+    pthread_mutex_unlock(&TraceLock);
+}
+
+static void openTrace()
+{
+    const char *path = getenv(TRACE_FILE_VARIABLE);
+    if (!path || !*path)
+        return;
+
+    if (pthread_key_create(&TraceBufferKey, releaseBuffer))
+        return;
+    TraceStream = fopen(path, "w");
+    if (!TraceStream)
+        return;
+
+    fputs("[\n", TraceStream);
+    TraceProcess = (int)getpid();
+    TraceEnabled = 1;
+    atexit(closeTrace);
+}
+
+// Return the buffer of the calling thread, or NULL if it cannot be created.
+static struct TraceBuffer *getBuffer()
+{
+    if (TraceThreadBuffer)
+        return TraceThreadBuffer;
+
+    struct TraceBuffer *buffer = (struct TraceBuffer *)calloc(1, sizeof(struct TraceBuffer));
+    if (!buffer)
+        return NULL;
+    buffer->capacity = TRACE_FLUSH_SIZE + TRACE_EVENT_SIZE;
+    buffer->data = (char *)malloc(buffer->capacity);
+    if (!buffer->data || pthread_setspecific(TraceBufferKey, buffer)) {
+        free(buffer->data);
+        free(buffer);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&TraceLock);
+    buffer->thread = ++TraceThreadCount;
+    buffer->next = TraceBuffers;
+    TraceBuffers = buffer;
+    pthread_mutex_unlock(&TraceLock);
+
+    TraceThreadBuffer = buffer;
+    return buffer;
+}
+
+// Make room for size more bytes in buffer.
+static int reserve(struct TraceBuffer *buffer, size_t size)
+{
+    if (buffer->length + size <= buffer->capacity)
+        return 0;
+
+    char *data = (char *)realloc(buffer->data, buffer->length + size);
+    if (!data)
+        return -1;
+    buffer->data = data;
+    buffer->capacity = buffer->length + size;
+    return 0;
+}
+
+// Append str as a JSON string; buffer must have room for 6 bytes per character plus 2.
+static void appendString(struct TraceBuffer *buffer, const char *str)
+{
+    char *out = &buffer->data[buffer->length];
+    *out++ = '"';
+    for (; *str; ++str) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
+        } else if (c < 0x20) {
+            out += sprintf(out, "\\u%04x", c);
+        } else {
+            *out++ = c;
+        }
+    }
+    *out++ = '"';
+    buffer->length = out - buffer->data;
+}
+
+// Append a formatted string; buffer must have room for it.
+static void appendFormat(struct TraceBuffer *buffer, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    buffer->length += vsnprintf(&buffer->data[buffer->length], buffer->capacity - buffer->length, format, args);
+    va_end(args);
+}
+
+// Monotonic time in nanoseconds.
+uint64_t traceTimestamp()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+void traceSpan(const char *name, uint64_t start, const char *file, uint64_t bytes)
+{
+    uint64_t end = traceTimestamp();
+
+    pthread_once(&TraceOnce, openTrace);
+    if (!TraceEnabled)
+        return;
+
+    struct TraceBuffer *buffer = getBuffer();
+    if (!buffer || reserve(buffer, TRACE_EVENT_SIZE + 6*(strlen(name) + (file ? strlen(file) : 0))))
+        return;
+
+    // Timestamps and durations are given in microseconds.
+    appendFormat(buffer, "%s{\"name\":", buffer->length ? ",\n" : "");
+    appendString(buffer, name);
+    appendFormat(buffer, ",\"cat\":\"pesx\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%llu",
+                 TraceProcess, buffer->thread, start / 1000.0, (end - start) / 1000.0, (unsigned long long)bytes);
+    if (file) {
+        appendFormat(buffer, ",\"file\":");
+        appendString(buffer, file);
+    }
+    appendFormat(buffer, "}}");
+
+    if (buffer->length >= TRACE_FLUSH_SIZE) {
+        pthread_mutex_lock(&TraceLock);
+        flushLocked(buffer);
+        pthread_mutex_unlock(&TraceLock);
+    }
+}
@@ -0,0 +1,74 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+// Trace points for finding out where the time goes, e.g. seeding the generator for many tiny blocks
+// versus generating the keystream for a large data block versus reading and writing files.
+//
+// When built with the PESX_TRACE option, every span between TRACE_BEGIN and TRACE_END is written as a
+// Chrome trace event to the file named by the environment variable PESX_TRACE_FILE, which can be opened in
+// chrome://tracing or https://ui.perfetto.dev. Spans nest per thread, so a file span contains its block spans,
+// which contain their seed and keystream spans. Without PESX_TRACE, the trace points compile to nothing.
+
+#ifdef PESX_TRACE
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_FILE_VARIABLE "PESX_TRACE_FILE"
+
+uint64_t traceTimestamp();
+void traceSpan(const char *name, uint64_t start, const char *file, uint64_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+// Start a span; span is a name for it that is unique within the scope.
+#define TRACE_BEGIN(span) uint64_t span##TraceStart = traceTimestamp()
+
+// End a span and record it as name, along with the file it belongs to (or NULL) and the number of bytes processed.
+#define TRACE_END(span, name, file, bytes) traceSpan(name, span##TraceStart, file, bytes)
+
+#else
+
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, name, file, bytes)
+
+#endif /* PESX_TRACE */
+
+// Name of a block following the file header, for use as span name.
+#define TRACE_BLOCK_NAME(block) ((block) == BLOCK_DESCRIPTION ? "description" \
+                               : (block) == BLOCK_LOGO ? "logo" \
+                               : (block) == BLOCK_DATA ? "data" : "serial")
+
+#endif /* _TRACE_H */
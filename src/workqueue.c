@@ -0,0 +1,166 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "workqueue.h"
+
+struct WorkItem
+{
+    WorkFunction function;
+    void *argument;
+};
+
+struct WorkQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+
+    struct WorkItem *items;
+    int capacity;
+    int head;
+    int count;
+    int stopping;
+
+    pthread_t *threads;
+    int threadCount;
+};
+
+static void *workerMain(void *argument)
+{
+    struct WorkQueue *queue = (struct WorkQueue *)argument;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (!queue->count && !queue->stopping)
+            pthread_cond_wait(&queue->notEmpty, &queue->lock);
+        if (!queue->count) {
+            pthread_mutex_unlock(&queue->lock);
+            return NULL;
+        }
+
+        struct WorkItem item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        --queue->count;
+        pthread_cond_signal(&queue->notFull);
+        pthread_mutex_unlock(&queue->lock);
+
+        item.function(item.argument);
+    }
+}
+
+struct WorkQueue *createWorkQueue(int threadCount, int capacity)
+{
+    if (threadCount < 1 || capacity < 1)
+        return NULL;
+
+    struct WorkQueue *queue = (struct WorkQueue *)calloc(1, sizeof(struct WorkQueue));
+    if (!queue)
+        return NULL;
+
+    queue->items    = (struct WorkItem *)malloc(capacity * sizeof(struct WorkItem));
+    queue->threads  = (pthread_t *)malloc(threadCount * sizeof(pthread_t));
+    queue->capacity = capacity;
+    if (!queue->items || !queue->threads) {
+        free(queue->items);
+        free(queue->threads);
+        free(queue);
+        return NULL;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+
+    for (int i = 0; i < threadCount; ++i) {
+        if (pthread_create(&queue->threads[i], NULL, workerMain, queue))
+            break;
+        ++queue->threadCount;
+    }
+    if (!queue->threadCount) {
+        destroyWorkQueue(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+static int enqueue(struct WorkQueue *queue, WorkFunction function, void *argument, int wait)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (wait && queue->count == queue->capacity && !queue->stopping)
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+    if (queue->stopping || queue->count == queue->capacity) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    struct WorkItem *item = &queue->items[(queue->head + queue->count) % queue->capacity];
+    item->function = function;
+    item->argument = argument;
+    ++queue->count;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+
+    return 0;
+}
+
+// Queue function to be run on one of the workers.
+// Blocks while the queue is full; returns -1 if the queue is being destroyed.
+int submitWork(struct WorkQueue *queue, WorkFunction function, void *argument)
+{
+    return enqueue(queue, function, argument, 1);
+}
+
+// Queue function to be run on one of the workers without ever blocking.
+// Returns -1 if the queue is full or being destroyed.
+int trySubmitWork(struct WorkQueue *queue, WorkFunction function, void *argument)
+{
+    return enqueue(queue, function, argument, 0);
+}
+
+// Run all work still queued, then stop the workers and free the queue.
+void destroyWorkQueue(struct WorkQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->notEmpty);
+    pthread_cond_broadcast(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (int i = 0; i < queue->threadCount; ++i)
+        pthread_join(queue->threads[i], NULL);
+
+    pthread_cond_destroy(&queue->notFull);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->threads);
+    free(queue->items);
+    free(queue);
+}
@@ -0,0 +1,50 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+#ifndef _WORKQUEUE_H
+#define _WORKQUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*WorkFunction)(void *argument);
+
+// Fixed pool of worker threads fed by a bounded queue.
+// Submitting blocks while the queue is full, which pushes back on the producer.
+struct WorkQueue;
+
+struct WorkQueue *createWorkQueue(int threadCount, int capacity);
+int submitWork(struct WorkQueue *queue, WorkFunction function, void *argument);
+int trySubmitWork(struct WorkQueue *queue, WorkFunction function, void *argument);
+void destroyWorkQueue(struct WorkQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _WORKQUEUE_H */
@@ -0,0 +1,258 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+// Tests of the asynchronous API in async.h and its coroutine layer in async.hpp.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <poll.h>
+
+#include "async.hpp"
+
+#define REQUEST_COUNT 16
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition) {
+        std::printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// Coroutine that starts right away and is not awaited by anyone.
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// An encrypted test file and its decrypted image.
+struct TestFile
+{
+    pesx::SaveFile image;
+    std::vector<std::uint8_t> encrypted;
+};
+
+static TestFile createTestFile(const MasterKeyInfo &masterKey)
+{
+    std::vector<std::uint8_t> encryptionHeader(ENCRYPTION_HEADER_SIZE), fileHeader(masterKey.fileHeaderSize);
+    std::vector<std::uint8_t> description(1001), logo(5003), data(300007), serial(40);
+    for (std::vector<std::uint8_t> *part : { &encryptionHeader, &fileHeader, &description, &logo, &data, &serial })
+        for (std::size_t i = 0; i < part->size(); ++i)
+            (*part)[i] = static_cast<std::uint8_t>(i * 7 + part->size());
+
+    TestFile file;
+    pesx::SaveFile::create(masterKey, encryptionHeader, fileHeader, description, logo, data, serial, file.image);
+    file.encrypted.resize(file.image.size());
+    file.image.encrypt(file.encrypted);
+    return file;
+}
+
+static bool matches(const TestFile &file, const std::vector<std::uint8_t> &output)
+{
+    return output.size() == file.image.size() && !std::memcmp(output.data(), file.image.bytes().data(), output.size());
+}
+
+static CryptRequest decryptRequest(const TestFile &file, std::vector<std::uint8_t> &output, const MasterKeyInfo &masterKey)
+{
+    CryptRequest request{};
+    request.operation = CRYPT_DECRYPT;
+    request.input     = file.encrypted.data();
+    request.output    = output.data();
+    request.size      = static_cast<std::uint32_t>(file.encrypted.size());
+    request.masterKey = &masterKey;
+    return request;
+}
+
+// Callback keeping the only worker of a pool busy until released.
+struct Blocker
+{
+    std::mutex lock;
+    std::condition_variable changed;
+    bool started = false;
+    bool released = false;
+
+    static void run(CryptRequest *request)
+    {
+        Blocker *blocker = static_cast<Blocker *>(request->userData);
+        std::unique_lock<std::mutex> lock(blocker->lock);
+        blocker->started = true;
+        blocker->changed.notify_all();
+        blocker->changed.wait(lock, [blocker] { return blocker->released; });
+    }
+};
+
+static Task awaitQueueFull(const pesx::CryptPoolHandle &pool, const TestFile &file, std::vector<std::uint8_t> &output,
+                           const MasterKeyInfo &masterKey, pesx::Error &result)
+{
+    result = co_await pesx::decryptAsync(pool, file.encrypted, output, masterKey);
+}
+
+static void testQueueFull(const TestFile &file, const MasterKeyInfo &masterKey)
+{
+    auto pool = std::make_unique<pesx::CryptPoolHandle>(1, 1);
+    std::vector<std::uint8_t> blockedOutput(file.encrypted.size()), queuedOutput(file.encrypted.size()), rejectedOutput(file.encrypted.size());
+
+    Blocker blocker;
+    CryptRequest blocked = decryptRequest(file, blockedOutput, masterKey);
+    blocked.callback = &Blocker::run;
+    blocked.userData = &blocker;
+    check(submitCryptRequest(pool->get(), &blocked) == CRYPT_OK, "submitting to an idle pool");
+    {
+        std::unique_lock<std::mutex> lock(blocker.lock);
+        blocker.changed.wait(lock, [&blocker] { return blocker.started; });
+    }
+
+    // The worker is busy, so the queue takes exactly one more request.
+    std::atomic<int> completed{0};
+    CryptRequest queued = decryptRequest(file, queuedOutput, masterKey);
+    queued.callback = [](CryptRequest *request) { ++*static_cast<std::atomic<int> *>(request->userData); };
+    queued.userData = &completed;
+    check(submitCryptRequest(pool->get(), &queued) == CRYPT_OK, "submitting to a pool with a free queue slot");
+
+    CryptRequest rejected = decryptRequest(file, rejectedOutput, masterKey);
+    check(submitCryptRequest(pool->get(), &rejected) == CRYPT_ERROR_QUEUE_FULL, "submitting to a full pool");
+
+    // Awaiting a request that cannot be submitted returns the error right away, without suspending.
+    pesx::Error result = pesx::Error::None;
+    awaitQueueFull(*pool, file, rejectedOutput, masterKey, result);
+    check(result == pesx::Error::QueueFull, "awaiting a request on a full pool");
+
+    {
+        std::lock_guard<std::mutex> lock(blocker.lock);
+        blocker.released = true;
+        blocker.changed.notify_all();
+    }
+    pool.reset();
+    check(completed == 1 && queued.result == CRYPT_OK && matches(file, queuedOutput), "request queued on a full pool");
+}
+
+static void testDrain(const TestFile &file, const MasterKeyInfo &masterKey)
+{
+    // Completions without callback are collected through the completion descriptor until all have arrived.
+    CryptPool *pool = createCryptPool(2, REQUEST_COUNT);
+    std::vector<std::vector<std::uint8_t>> outputs(REQUEST_COUNT, std::vector<std::uint8_t>(file.encrypted.size()));
+    std::vector<CryptRequest> requests;
+    for (int i = 0; i < REQUEST_COUNT; ++i)
+        requests.push_back(decryptRequest(file, outputs[i], masterKey));
+    for (CryptRequest &request : requests)
+        check(submitCryptRequest(pool, &request) == CRYPT_OK, "submitting to a pool with free queue slots");
+
+    int completed = 0;
+    struct pollfd fd = { getCryptCompletionFd(pool), POLLIN, 0 };
+    while (completed < REQUEST_COUNT && poll(&fd, 1, 10000) == 1)
+        while (CryptRequest *request = pollCryptCompletion(pool)) {
+            check(request->result == CRYPT_OK && matches(file, outputs[request - requests.data()]), "drained request");
+            ++completed;
+        }
+    check(completed == REQUEST_COUNT, "draining all requests");
+    check(!pollCryptCompletion(pool) && poll(&fd, 1, 0) == 0, "completion descriptor of a drained pool");
+    destroyCryptPool(pool);
+
+    // Destroying a pool finishes all requests still queued.
+    std::atomic<int> finished{0};
+    pool = createCryptPool(1, REQUEST_COUNT);
+    for (CryptRequest &request : requests) {
+        request = decryptRequest(file, outputs[&request - requests.data()], masterKey);
+        request.callback = [](CryptRequest *request) { ++*static_cast<std::atomic<int> *>(request->userData); };
+        request.userData = &finished;
+        check(submitCryptRequest(pool, &request) == CRYPT_OK, "submitting to a pool with free queue slots");
+    }
+    destroyCryptPool(pool);
+    check(finished == REQUEST_COUNT, "destroying a pool with queued requests");
+}
+
+static Task awaitOnWorker(const pesx::CryptPoolHandle &pool, const TestFile &file, std::vector<std::uint8_t> &output,
+                          const MasterKeyInfo &masterKey, std::atomic<std::thread::id> &resumedOn)
+{
+    pesx::Error result = co_await pesx::decryptAsync(pool, file.encrypted, output, masterKey);
+    check(result == pesx::Error::None && matches(file, output), "awaiting a request resumed on the worker");
+    resumedOn = std::this_thread::get_id();
+}
+
+static Task awaitOnCaller(std::unique_ptr<pesx::CryptPoolHandle> &pool, const TestFile &file, std::vector<std::uint8_t> &output,
+                          const MasterKeyInfo &masterKey, bool &done)
+{
+    pesx::Error result = co_await pesx::decryptAsync(*pool, file.encrypted, output, masterKey, pesx::ResumeOn::Caller);
+    check(result == pesx::Error::None && matches(file, output), "awaiting a request resumed on the caller");
+
+    // Resumed on the thread of the event loop, the coroutine may destroy the pool.
+    pool.reset();
+    done = true;
+}
+
+static void testCoroutines(const TestFile &file, const MasterKeyInfo &masterKey)
+{
+    std::vector<std::uint8_t> output(file.encrypted.size());
+    std::atomic<std::thread::id> resumedOn{};
+    {
+        pesx::CryptPoolHandle pool(1, 1);
+        awaitOnWorker(pool, file, output, masterKey, resumedOn);
+    }
+    // The handle went out of scope, so the pool has finished the request.
+    check(resumedOn.load() != std::thread::id() && resumedOn.load() != std::this_thread::get_id(), "resuming on the worker");
+
+    auto pool = std::make_unique<pesx::CryptPoolHandle>(1, 1);
+    int fd = getCryptCompletionFd(pool->get());
+    bool done = false;
+    awaitOnCaller(pool, file, output, masterKey, done);
+    for (int i = 0; i < 100 && !done; ++i) {
+        struct pollfd pollFd = { fd, POLLIN, 0 };
+        poll(&pollFd, 1, 100);
+        pesx::resumeCompleted(*pool);
+    }
+    check(done && !pool, "resuming on the caller");
+}
+
+int main()
+{
+    const MasterKeyInfo *masterKey = findMasterKey("21");
+    TestFile file = createTestFile(*masterKey);
+
+    testQueueFull(file, *masterKey);
+    testDrain(file, *masterKey);
+    testCoroutines(file, *masterKey);
+
+    if (failures)
+        std::printf("%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,740 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+// Conformance and performance tests of the crypt functions.
+//
+// Every optimised path of the library is checked byte for byte against a reference implementation
+// built on the scalar generator of mt19937ar.c, for a synthetic file per key of the registry.
+// Then the throughput of decrypting and encrypting these files is measured and compared against a
+// baseline file, which holds the relative throughput per build type, key, and operation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mt19937ar.h"
+#include "crypt.h"
+#include "masterkey.h"
+
+// Exit code telling CTest that the test was skipped.
+#define EXIT_SKIPPED 77
+
+#ifndef PERF_BUILD_TYPE
+#define PERF_BUILD_TYPE ""
+#endif
+
+// Block sizes of the synthetic files. Odd sizes make sure partial keystream words are covered.
+#define TEST_DESC_SIZE     2049
+#define TEST_LOGO_SIZE     65537
+#define TEST_DATA_SIZE     (1024*1024 + 3)
+#define TEST_SERIAL_LENGTH 501
+
+#ifndef PERF_GOLDEN_DIR
+#define PERF_GOLDEN_DIR "tests/golden"
+#endif
+
+// Size of the blocks of the golden files in PERF_GOLDEN_DIR.
+#define GOLDEN_DESC_SIZE     5
+#define GOLDEN_LOGO_SIZE     7
+#define GOLDEN_DATA_SIZE     13
+#define GOLDEN_SERIAL_LENGTH 3
+
+// Each measurement is taken PERF_SAMPLES times and the median is used, to filter out noise from other processes.
+// A sample repeats the operation until it took at least PERF_SAMPLE_SECONDS.
+#define PERF_SAMPLES        25
+#define PERF_SAMPLE_SECONDS 0.002
+
+#define DEFAULT_TOLERANCE 0.25
+
+#define MAX_BASELINE_ENTRIES 256
+
+struct BaselineEntry
+{
+    char buildType[32];
+    char key[MASTER_KEY_NAME_LENGTH];
+    char operation[32];
+    double relativeThroughput;
+};
+
+// Library internals that are not exported.
+void cryptStream(uint8_t *output, const uint8_t *key, const uint8_t *input, int length);
+
+static int failures = 0;
+
+static void check(int condition, const char *what, const char *key)
+{
+    if (!condition) {
+        printf("FAIL: %s (key %s)\n", what, key);
+        ++failures;
+    }
+}
+
+// *** Reference implementation ***
+
+static uint32_t referenceRol(uint32_t a, uint32_t shift)
+{
+    return (a << shift) | (a >> (32 - shift));
+}
+
+static uint32_t referenceRor(uint32_t a, uint32_t shift)
+{
+    return (a >> shift) | (a << (32 - shift));
+}
+
+// The original cryptStream, one word at a time on the global generator.
+// The generator itself is checked against its published outputs by verifyKnownAnswers.
+static void referenceCryptStream(uint8_t *output, const uint8_t *key, const uint8_t *input, int length)
+{
+    uint32_t keyWords[16];
+    memcpy(keyWords, key, 64);
+
+    init_by_array(keyWords, 16);
+    uint32_t c0 = genrand_int32();
+    uint32_t c1 = genrand_int32();
+    uint32_t c2 = genrand_int32();
+    uint32_t c3 = genrand_int32();
+
+    for (int i = 0; i < length/4; ++i) {
+        uint32_t c4 = genrand_int32();
+
+        uint32_t word;
+        memcpy(&word, &input[i*4], 4);
+        word ^= c4 ^ c3 ^ c2 ^ c1 ^ c0;
+        memcpy(&output[i*4], &word, 4);
+
+        c0 = referenceRor(c1, 15);
+        c1 = referenceRol(c2, 11);
+        c2 = referenceRol(c3, 7);
+        c3 = referenceRor(c4, 13);
+    }
+    if (length & 3) {
+        uint32_t rest = 0;
+        memcpy(&rest, &input[length & (~3)], length & 3);
+
+        rest ^= genrand_int32() ^ c3 ^ c2 ^ c1 ^ c0;
+
+        memcpy(&output[length & (~3)], &rest, length & 3);
+    }
+}
+
+static void referenceIntermediateKey(uint8_t *intermediateKey, const uint8_t *rollingKey, uint64_t param)
+{
+    uint8_t paramBytes[8];
+    memcpy(paramBytes, &param, 8);
+    for (int i = 0; i < 64; ++i)
+        intermediateKey[i] = rollingKey[i] ^ paramBytes[i & 7];
+}
+
+// Encrypt the encryption header and the file header of a decrypted image, and return the rolling key.
+static void referenceEncryptHeaders(uint8_t *output, uint8_t *rollingKey, const uint8_t *image, const struct MasterKeyInfo *masterKey)
+{
+    uint8_t headerKey[64], intermediateKey[64];
+    for (int i = 0; i < 64; ++i) {
+        headerKey[i] = image[256 + i] ^ masterKey->shuffledKey[i];
+        rollingKey[i] = image[i] ^ image[64 + i] ^ image[128 + i] ^ image[192 + i] ^ image[256 + i];
+    }
+    referenceCryptStream(output, headerKey, image, ENCRYPTION_HEADER_SIZE);
+    memcpy(&output[256], &image[256], 64);
+
+    referenceIntermediateKey(intermediateKey, rollingKey, masterKey->fileHeaderSize);
+    referenceCryptStream(&output[ENCRYPTION_HEADER_SIZE], intermediateKey, &image[ENCRYPTION_HEADER_SIZE], masterKey->fileHeaderSize);
+}
+
+// Encrypt a decrypted image, stream by stream.
+static void referenceEncryptImage(uint8_t *output, const uint8_t *image, const struct MasterKeyInfo *masterKey)
+{
+    uint8_t rollingKey[64], intermediateKey[64];
+    referenceEncryptHeaders(output, rollingKey, image, masterKey);
+
+    struct FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, &image[ENCRYPTION_HEADER_SIZE], masterKey->fileHeaderSize);
+
+    uint32_t offset = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize;
+    uint32_t sizes[4] = { header.descSize, header.logoSize, header.dataSize, header.serialLength*2 };
+    for (int i = 0; i < 4; ++i) {
+        referenceIntermediateKey(intermediateKey, rollingKey, i);
+        referenceCryptStream(&output[offset], intermediateKey, &image[offset], sizes[i]);
+        offset += sizes[i];
+    }
+}
+
+// *** Synthetic files ***
+
+static uint32_t randomState = 0x12345678;
+
+static uint8_t randomByte()
+{
+    randomState = randomState*1664525 + 1013904223;
+    return (uint8_t)(randomState >> 24);
+}
+
+static void fillRandom(uint8_t *data, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; ++i)
+        data[i] = randomByte();
+}
+
+// Create the decrypted image of a file for masterKey.
+static uint8_t *createImage(const struct MasterKeyInfo *masterKey, uint32_t *size)
+{
+    struct FileHeader header;
+    fillRandom((uint8_t *)&header, sizeof(header));
+    header.descSize = TEST_DESC_SIZE;
+    header.logoSize = TEST_LOGO_SIZE;
+    header.dataSize = TEST_DATA_SIZE;
+    header.serialLength = TEST_SERIAL_LENGTH;
+
+    *size = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize
+          + TEST_DESC_SIZE + TEST_LOGO_SIZE + TEST_DATA_SIZE + TEST_SERIAL_LENGTH*2;
+    uint8_t *image = (uint8_t *)malloc(*size);
+    if (!image)
+        return NULL;
+
+    fillRandom(image, *size);
+    memcpy(&image[ENCRYPTION_HEADER_SIZE], &header, masterKey->fileHeaderSize);
+    return image;
+}
+
+// Create the decrypted image of the golden file of masterKey: every byte follows a fixed pattern,
+// except for the block sizes and the file type.
+static uint8_t *createGoldenImage(const struct MasterKeyInfo *masterKey, uint32_t *size)
+{
+    struct FileHeader header;
+    for (uint32_t i = 0; i < sizeof(header); ++i)
+        ((uint8_t *)&header)[i] = (uint8_t)(i*11 + 5);
+    header.descSize = GOLDEN_DESC_SIZE;
+    header.logoSize = GOLDEN_LOGO_SIZE;
+    header.dataSize = GOLDEN_DATA_SIZE;
+    header.serialLength = GOLDEN_SERIAL_LENGTH;
+    memset(header.fileTypeString, 0, sizeof(header.fileTypeString));
+    memcpy(header.fileTypeString, "EDIT", 4);
+
+    *size = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize
+          + GOLDEN_DESC_SIZE + GOLDEN_LOGO_SIZE + GOLDEN_DATA_SIZE + GOLDEN_SERIAL_LENGTH*2;
+    uint8_t *image = (uint8_t *)malloc(*size);
+    if (!image)
+        return NULL;
+
+    for (uint32_t i = 0; i < ENCRYPTION_HEADER_SIZE; ++i)
+        image[i] = (uint8_t)(i*7 + 3);
+    memcpy(&image[ENCRYPTION_HEADER_SIZE], &header, masterKey->fileHeaderSize);
+
+    uint32_t offset = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize;
+    uint32_t sizes[4] = { GOLDEN_DESC_SIZE, GOLDEN_LOGO_SIZE, GOLDEN_DATA_SIZE, GOLDEN_SERIAL_LENGTH*2 };
+    for (uint32_t block = 0; block < 4; ++block) {
+        for (uint32_t i = 0; i < sizes[block]; ++i)
+            image[offset + i] = (uint8_t)(i*13 + block*17);
+        offset += sizes[block];
+    }
+    return image;
+}
+
+// *** Conformance ***
+
+// Outputs of genrand_int32 after init_by_array({ 0x123, 0x234, 0x345, 0x456 }, 4), as published with mt19937ar.
+static const uint32_t KnownOutputs[10] = {
+    1067595299u,  955945823u,  477289528u, 4107218783u, 4228976476u,
+    3344332714u, 3355579695u,  227628506u,  810200273u, 2591290167u
+};
+static const uint32_t KnownOutput1000 = 3460025646u;
+
+// Check the generator against its published outputs, and the library against files encrypted by
+// an independent implementation, so that a bug shared with the reference implementation cannot go unnoticed.
+static void verifyKnownAnswers()
+{
+    uint32_t initKey[4] = { 0x123, 0x234, 0x345, 0x456 };
+    struct mt19937ar state;
+    init_by_array(initKey, 4);
+    init_by_array_r(&state, initKey, 4);
+
+    int matches = 1;
+    for (int i = 0; i < 1000; ++i) {
+        uint32_t output = genrand_int32();
+        uint32_t expected = i < 10 ? KnownOutputs[i] : i == 999 ? KnownOutput1000 : output;
+        if (output != expected || genrand_int32_r(&state) != output)
+            matches = 0;
+    }
+    if (!matches) {
+        printf("FAIL: the generator differs from the published mt19937ar outputs\n");
+        ++failures;
+    }
+
+    const char *names[] = { "16", "21" };
+    for (int i = 0; i < 2; ++i) {
+        const struct MasterKeyInfo *masterKey = findMasterKey(names[i]);
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s.bin", PERF_GOLDEN_DIR, names[i]);
+
+        uint32_t size, goldenSize = 0;
+        uint8_t *image = createGoldenImage(masterKey, &size);
+        uint8_t *golden = readFile(path, &goldenSize);
+        uint8_t *output = (uint8_t *)malloc(size);
+        if (!image || !golden || !output || goldenSize != size) {
+            check(0, "reading the golden file", names[i]);
+        } else {
+            check(!encryptImage(output, image, size, masterKey) && !memcmp(output, golden, size),
+                  "encryptImage of the golden file", names[i]);
+            check(!decryptImage(output, golden, size, masterKey) && !memcmp(output, image, size),
+                  "decryptImage of the golden file", names[i]);
+        }
+        free(image);
+        free(golden);
+        free(output);
+    }
+}
+
+static void verifyStreams()
+{
+    uint8_t key[64], input[1024], expected[1024], output[1024];
+
+    for (int length = 0; length <= (int)sizeof(input); length += (length < 72 ? 1 : 61)) {
+        fillRandom(key, sizeof(key));
+        fillRandom(input, sizeof(input));
+        referenceCryptStream(expected, key, input, length);
+        cryptStream(output, key, input, length);
+        if (memcmp(output, expected, length)) {
+            printf("FAIL: cryptStream differs from the reference for length %d\n", length);
+            ++failures;
+        }
+    }
+}
+
+static void verifyKey(const struct MasterKeyInfo *masterKey)
+{
+    uint32_t size;
+    uint8_t *image = createImage(masterKey, &size);
+    uint8_t *expected = (uint8_t *)malloc(size);
+    uint8_t *output = (uint8_t *)malloc(size);
+    if (!image || !expected || !output) {
+        check(0, "allocating the test file", masterKey->name);
+        free(image);
+        free(expected);
+        free(output);
+        return;
+    }
+
+    referenceEncryptImage(expected, image, masterKey);
+
+    check(encryptImage(output, image, size, masterKey) == CRYPT_OK
+          && !memcmp(output, expected, size), "encryptImage", masterKey->name);
+
+    struct KeystreamCache *cache = createKeystreamCache(2*size);
+    for (int i = 0; i < 2; ++i) {
+        memset(output, 0, size);
+        check(encryptImageCached(output, image, size, masterKey, cache) == CRYPT_OK
+              && !memcmp(output, expected, size), i ? "encryptImageCached, warm" : "encryptImageCached, cold", masterKey->name);
+    }
+    destroyKeystreamCache(cache);
+
+    check(decryptImage(output, expected, size, masterKey) == CRYPT_OK
+          && !memcmp(output, image, size), "decryptImage", masterKey->name);
+
+    memcpy(output, expected, size);
+    check(decryptImage(output, output, size, masterKey) == CRYPT_OK
+          && !memcmp(output, image, size), "decryptImage in place", masterKey->name);
+
+    struct FileDescriptor *descriptor = createFileDescriptor();
+    if (decryptWithKeyInfoChecked(descriptor, expected, size, masterKey, 0) == CRYPT_OK) {
+        int encryptedSize;
+        uint8_t *encrypted = encryptWithKeyInfo(descriptor, &encryptedSize, masterKey);
+        check(encrypted && (uint32_t)encryptedSize == size && !memcmp(encrypted, expected, size),
+              "decryptWithKeyInfoChecked and encryptWithKeyInfo", masterKey->name);
+        free(encrypted);
+    } else {
+        check(0, "decryptWithKeyInfoChecked", masterKey->name);
+    }
+    destroyFileDescriptor(descriptor);
+
+    // Files that are cut off or whose blocks are too large are turned down by their headers alone.
+    uint32_t headerSize = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize;
+    check(validateWithKeyInfo(NULL, expected, size, masterKey, 0) == CRYPT_OK, "validateWithKeyInfo", masterKey->name);
+    check(validateWithKeyInfo(NULL, expected, size - 1, masterKey, 0) == CRYPT_ERROR_INVALID_SIZE,
+          "validateWithKeyInfo of a truncated file", masterKey->name);
+    check(validateWithKeyInfo(NULL, expected, headerSize - 1, masterKey, 0) == CRYPT_ERROR_INVALID_SIZE,
+          "validateWithKeyInfo of a truncated header", masterKey->name);
+    check(validateWithKeyInfo(NULL, expected, size, masterKey, TEST_DATA_SIZE - 1) == CRYPT_ERROR_BLOCK_TOO_LARGE,
+          "validateWithKeyInfo of a file with a block that is too large", masterKey->name);
+
+    descriptor = createFileDescriptor();
+    check(decryptWithKeyInfoChecked(descriptor, expected, size - 1, masterKey, 0) == CRYPT_ERROR_INVALID_SIZE
+          && !descriptor->data, "decryptWithKeyInfoChecked of a truncated file", masterKey->name);
+    destroyFileDescriptor(descriptor);
+
+    free(image);
+    free(expected);
+    free(output);
+}
+
+// Write size bytes of data to a file at path that is length bytes long; the rest of it is left sparse.
+static int writeTestFile(const char *path, const uint8_t *data, uint32_t size, uint64_t length)
+{
+    FILE *stream = fopen(path, "wb");
+    if (!stream)
+        return -1;
+    int result = fwrite(data, 1, size, stream) == size ? 0 : -1;
+    if (!result && length > size)
+        result = (fseek(stream, (long)(length - 1), SEEK_SET) || fputc(0, stream) == EOF) ? -1 : 0;
+    return (fclose(stream) || result) ? -1 : 0;
+}
+
+// Check that decryptWithKeyInfo_ex turns down files with truncated or oversized headers.
+static void verifyFiles(const struct MasterKeyInfo *masterKey)
+{
+    const char *path = "perftest-input.bin", *outputPath = "perftest-output";
+    uint32_t headerSize = ENCRYPTION_HEADER_SIZE + masterKey->fileHeaderSize;
+    uint8_t image[ENCRYPTION_HEADER_SIZE + sizeof(struct FileHeader)], encrypted[sizeof(image)], rollingKey[64];
+
+    fillRandom(image, sizeof(image));
+    struct FileHeader header;
+    memcpy(&header, &image[ENCRYPTION_HEADER_SIZE], sizeof(header));
+    header.descSize = header.logoSize = header.serialLength = 0;
+    header.dataSize = DEFAULT_MAX_BLOCK_SIZE + 1;
+    memcpy(&image[ENCRYPTION_HEADER_SIZE], &header, masterKey->fileHeaderSize);
+    referenceEncryptHeaders(encrypted, rollingKey, image, masterKey);
+
+    check(!writeTestFile(path, encrypted, headerSize - 1, 0)
+          && decryptWithKeyInfo_ex(path, outputPath, masterKey) == CRYPT_ERROR_INVALID_SIZE,
+          "decryptWithKeyInfo_ex of a truncated header", masterKey->name);
+
+    check(!writeTestFile(path, encrypted, headerSize, headerSize + (uint64_t)header.dataSize - 1)
+          && decryptWithKeyInfo_ex(path, outputPath, masterKey) == CRYPT_ERROR_INVALID_SIZE,
+          "decryptWithKeyInfo_ex of a truncated file", masterKey->name);
+
+    check(!writeTestFile(path, encrypted, headerSize, headerSize + (uint64_t)header.dataSize)
+          && decryptWithKeyInfo_ex(path, outputPath, masterKey) == CRYPT_ERROR_BLOCK_TOO_LARGE,
+          "decryptWithKeyInfo_ex of a file with a block that is too large", masterKey->name);
+
+    remove(path);
+}
+
+// *** Performance ***
+
+// The throughput measured on shared machines varies widely with whatever else is running. Therefore, each
+// operation is timed alternately with a fixed calibration loop that does not depend on the library,
+// and only the ratio between the two is compared against the baseline.
+enum Operation
+{
+    OPERATION_DECRYPT,
+    OPERATION_ENCRYPT,
+    OPERATION_ENCRYPT_CACHED,
+    OPERATION_COUNT,
+    OPERATION_CALIBRATION = OPERATION_COUNT
+};
+
+static const char *OperationNames[OPERATION_COUNT] = { "decrypt", "encrypt", "encrypt-cached" };
+
+struct Workload
+{
+    const struct MasterKeyInfo *masterKey;
+    uint8_t *image;
+    uint8_t *encrypted;
+    uint8_t *output;
+    uint32_t size;
+    struct KeystreamCache *cache;
+};
+
+// XOR input with the keystream of a lagged generator over a table of 624 words that is refilled in batches,
+// which is about the same kind and amount of work per byte as cryptStream, but does not depend on the library.
+static void calibrate(uint8_t *output, const uint8_t *input, uint32_t size)
+{
+    uint32_t table[624];
+    for (uint32_t i = 0; i < 624; ++i)
+        table[i] = i*0x9e3779b9 + 1;
+
+    uint32_t next = 624;
+    for (uint32_t i = 0; i + 4 <= size; i += 4) {
+        if (next == 624) {
+            for (uint32_t j = 0; j < 624; ++j) {
+                uint32_t y = (table[j] & 0x80000000) | (table[j + 1 < 624 ? j + 1 : 0] & 0x7fffffff);
+                table[j] = table[j + 397 < 624 ? j + 397 : j + 397 - 624] ^ (y >> 1) ^ ((y & 1) * 0x6c078965);
+            }
+            next = 0;
+        }
+        uint32_t state = table[next++];
+        state ^= state >> 11;
+        state ^= (state << 7) & 0x3ad7c2a5;
+        state ^= state >> 18;
+
+        uint32_t word;
+        memcpy(&word, &input[i], 4);
+        word ^= state;
+        memcpy(&output[i], &word, 4);
+    }
+}
+
+static void runOperation(struct Workload *workload, enum Operation operation)
+{
+    if (operation == OPERATION_DECRYPT)
+        decryptImage(workload->output, workload->encrypted, workload->size, workload->masterKey);
+    else if (operation == OPERATION_ENCRYPT)
+        encryptImage(workload->output, workload->image, workload->size, workload->masterKey);
+    else if (operation == OPERATION_ENCRYPT_CACHED)
+        encryptImageCached(workload->output, workload->image, workload->size, workload->masterKey, workload->cache);
+    else
+        calibrate(workload->output, workload->image, workload->size);
+}
+
+// Run the calibration loop and an operation in turns until the operation took at least PERF_SAMPLE_SECONDS.
+// Returns the throughput of the operation relative to the calibration loop, and stores its throughput in MB/s at throughput.
+static double sampleOperation(struct Workload *workload, enum Operation operation, double *throughput)
+{
+    double seconds = 0, calibrationSeconds = 0;
+    int iterations = 0;
+    do {
+        clock_t start = clock();
+        runOperation(workload, OPERATION_CALIBRATION);
+        clock_t middle = clock();
+        runOperation(workload, operation);
+        clock_t end = clock();
+
+        calibrationSeconds += (double)(middle - start) / CLOCKS_PER_SEC;
+        seconds += (double)(end - middle) / CLOCKS_PER_SEC;
+        ++iterations;
+    } while (seconds < PERF_SAMPLE_SECONDS);
+
+    *throughput = (double)workload->size*iterations / (1024*1024) / seconds;
+    return calibrationSeconds / seconds;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int count)
+{
+    qsort(values, count, sizeof(double), compareDoubles);
+    return count % 2 ? values[count/2] : (values[count/2 - 1] + values[count/2]) / 2;
+}
+
+static int createWorkload(struct Workload *workload, const struct MasterKeyInfo *masterKey)
+{
+    workload->masterKey = masterKey;
+    workload->image = createImage(masterKey, &workload->size);
+    workload->encrypted = (uint8_t *)malloc(workload->size);
+    workload->output = (uint8_t *)malloc(workload->size);
+    workload->cache = createKeystreamCache(2*workload->size);
+    if (!workload->image || !workload->encrypted || !workload->output || !workload->cache)
+        return -1;
+
+    encryptImageCached(workload->encrypted, workload->image, workload->size, masterKey, workload->cache);
+    return 0;
+}
+
+static void destroyWorkload(struct Workload *workload)
+{
+    destroyKeystreamCache(workload->cache);
+    free(workload->image);
+    free(workload->encrypted);
+    free(workload->output);
+}
+
+// Measure every operation on a synthetic file per key. The samples of all measurements are taken in turns,
+// so that they all see the same conditions, and the median of each is stored at relative and throughput,
+// indexed by key*OPERATION_COUNT + operation.
+static int measure(double *relative, double *throughput)
+{
+    int keyCount = getMasterKeyCount(), count = keyCount*OPERATION_COUNT;
+    struct Workload *workloads = (struct Workload *)calloc(keyCount, sizeof(struct Workload));
+    double *relativeSamples = (double *)malloc(count*PERF_SAMPLES*sizeof(double));
+    double *absoluteSamples = (double *)malloc(count*PERF_SAMPLES*sizeof(double));
+    int result = workloads && relativeSamples && absoluteSamples ? 0 : -1;
+
+    for (int i = 0; !result && i < keyCount; ++i)
+        result = createWorkload(&workloads[i], getMasterKeyInfo(i));
+
+    for (int sample = 0; !result && sample < PERF_SAMPLES; ++sample) {
+        for (int i = 0; i < count; ++i) {
+            enum Operation operation = (enum Operation)(i % OPERATION_COUNT);
+            relativeSamples[i*PERF_SAMPLES + sample] =
+                sampleOperation(&workloads[i / OPERATION_COUNT], operation, &absoluteSamples[i*PERF_SAMPLES + sample]);
+        }
+    }
+
+    for (int i = 0; !result && i < count; ++i) {
+        relative[i] = median(&relativeSamples[i*PERF_SAMPLES], PERF_SAMPLES);
+        throughput[i] = median(&absoluteSamples[i*PERF_SAMPLES], PERF_SAMPLES);
+    }
+
+    for (int i = 0; workloads && i < keyCount; ++i)
+        destroyWorkload(&workloads[i]);
+    free(workloads);
+    free(relativeSamples);
+    free(absoluteSamples);
+    return result;
+}
+
+static int readBaseline(const char *path, struct BaselineEntry *entries)
+{
+    FILE *stream = fopen(path, "r");
+    if (!stream)
+        return 0;
+
+    int count = 0;
+    char line[256];
+    while (count < MAX_BASELINE_ENTRIES && fgets(line, sizeof(line), stream)) {
+        if (line[0] == '#')
+            continue;
+        struct BaselineEntry *entry = &entries[count];
+        if (sscanf(line, "%31s %31s %31s %lf", entry->buildType, entry->key, entry->operation, &entry->relativeThroughput) == 4)
+            ++count;
+    }
+
+    fclose(stream);
+    return count;
+}
+
+static int writeBaseline(const char *path, const struct BaselineEntry *entries, int count)
+{
+    FILE *stream = fopen(path, "w");
+    if (!stream)
+        return -1;
+
+    fprintf(stream, "# Throughput of the synthetic workloads of tests/perftest.c, relative to its calibration loop.\n");
+    fprintf(stream, "# Regenerate the entries of a build type with the update_perf_baseline target.\n");
+    fprintf(stream, "# build_type key operation relative_throughput\n");
+    for (int i = 0; i < count; ++i)
+        fprintf(stream, "%s %s %s %.3f\n", entries[i].buildType, entries[i].key, entries[i].operation, entries[i].relativeThroughput);
+
+    return fclose(stream) ? -1 : 0;
+}
+
+static struct BaselineEntry *findBaselineEntry(struct BaselineEntry *entries, int count, const char *buildType,
+                                               const char *key, const char *operation)
+{
+    for (int i = 0; i < count; ++i)
+        if (!strcmp(entries[i].buildType, buildType) && !strcmp(entries[i].key, key) && !strcmp(entries[i].operation, operation))
+            return &entries[i];
+    return NULL;
+}
+
+static int runPerformance(const char *baselinePath, int update, double tolerance)
+{
+    static struct BaselineEntry entries[MAX_BASELINE_ENTRIES];
+    int count = readBaseline(baselinePath, entries);
+    const char *buildType = PERF_BUILD_TYPE[0] ? PERF_BUILD_TYPE : "Default";
+    int missing = 0;
+
+    double relative[MAX_BASELINE_ENTRIES], absolute[MAX_BASELINE_ENTRIES];
+    if (getMasterKeyCount()*OPERATION_COUNT > MAX_BASELINE_ENTRIES || measure(relative, absolute)) {
+        printf("Could not set up the measurements\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %-16s %10s %10s %10s\n", "key", "operation", "MB/s", "relative", "baseline");
+    for (int i = 0; i < getMasterKeyCount(); ++i) {
+        const struct MasterKeyInfo *masterKey = getMasterKeyInfo(i);
+
+        for (int operation = 0; operation < OPERATION_COUNT; ++operation) {
+            double throughput = absolute[i*OPERATION_COUNT + operation];
+            double relativeThroughput = relative[i*OPERATION_COUNT + operation];
+            struct BaselineEntry *entry = findBaselineEntry(entries, count, buildType, masterKey->name, OperationNames[operation]);
+
+            printf("%-10s %-16s %10.1f %10.3f ", masterKey->name, OperationNames[operation], throughput, relativeThroughput);
+            if (entry)
+                printf("%10.3f", entry->relativeThroughput);
+            else
+                printf("%10s", "-");
+
+            if (update) {
+                if (!entry && count < MAX_BASELINE_ENTRIES) {
+                    entry = &entries[count++];
+                    snprintf(entry->buildType, sizeof(entry->buildType), "%s", buildType);
+                    snprintf(entry->key, sizeof(entry->key), "%s", masterKey->name);
+                    snprintf(entry->operation, sizeof(entry->operation), "%s", OperationNames[operation]);
+                }
+                if (entry)
+                    entry->relativeThroughput = relativeThroughput;
+            } else if (!entry) {
+                ++missing;
+            } else if (relativeThroughput < entry->relativeThroughput * (1 - tolerance)) {
+                printf("  FAIL: slower than the baseline");
+                ++failures;
+            }
+            printf("\n");
+        }
+    }
+
+    if (update) {
+        if (writeBaseline(baselinePath, entries, count)) {
+            printf("Could not write %s\n", baselinePath);
+            return EXIT_FAILURE;
+        }
+        printf("Updated the %s baseline in %s\n", buildType, baselinePath);
+        return EXIT_SUCCESS;
+    }
+
+    if (failures)
+        return EXIT_FAILURE;
+    if (missing) {
+        printf("No %s baseline for %d measurements; run the update_perf_baseline target.\n", buildType, missing);
+        return EXIT_SKIPPED;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    int verifyOnly = 0, update = 0;
+    double tolerance = DEFAULT_TOLERANCE;
+    const char *baselinePath = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--verify"))
+            verifyOnly = 1;
+        else if (!strcmp(argv[i], "--update"))
+            update = 1;
+        else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+            tolerance = atof(argv[++i]);
+        else
+            baselinePath = argv[i];
+    }
+
+    if (!verifyOnly && !baselinePath) {
+        printf("Usage: perftest --verify | [--update] [--tolerance fraction] baseline_file\n");
+        return EXIT_FAILURE;
+    }
+
+    verifyKnownAnswers();
+    verifyStreams();
+    for (int i = 0; i < getMasterKeyCount(); ++i) {
+        verifyKey(getMasterKeyInfo(i));
+        verifyFiles(getMasterKeyInfo(i));
+    }
+
+    if (failures)
+        return EXIT_FAILURE;
+    if (verifyOnly) {
+        printf("All crypt paths match the reference implementation.\n");
+        return EXIT_SUCCESS;
+    }
+
+    return runPerformance(baselinePath, update, tolerance);
+}
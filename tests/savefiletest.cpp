@@ -0,0 +1,156 @@
+/*
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org>
+ */
+
+// Tests of the C++20 layer in crypt.hpp.
+//
+// A file is assembled from random parts, encrypted, and decrypted again through every path of SaveFile,
+// and the result is checked against the parts and against the C functions.
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "crypt.hpp"
+
+static int failures = 0;
+
+static void check(bool condition, const char *what, const char *key)
+{
+    if (!condition) {
+        std::printf("FAIL: %s (key %s)\n", what, key);
+        ++failures;
+    }
+}
+
+static bool equal(std::span<const std::uint8_t> a, std::span<const std::uint8_t> b)
+{
+    return a.size() == b.size() && (a.empty() || !std::memcmp(a.data(), b.data(), a.size()));
+}
+
+static std::vector<std::uint8_t> randomBytes(std::mt19937 &random, std::size_t size)
+{
+    std::vector<std::uint8_t> result(size);
+    for (std::uint8_t &byte : result)
+        byte = static_cast<std::uint8_t>(random());
+    return result;
+}
+
+static void testEmpty()
+{
+    const pesx::SaveFile file;
+    check(file.empty() && file.size() == 0 && !file.masterKey(), "empty SaveFile", "none");
+    check(file.encryptionHeader().empty() && file.fileHeader().empty() && file.description().empty()
+          && file.logo().empty() && file.data().empty() && file.serial().empty(), "blocks of an empty SaveFile", "none");
+    check(file.fileType().empty() && file.gameVersion().empty() && file.header().dataSize == 0,
+          "header of an empty SaveFile", "none");
+
+    std::uint8_t output[1];
+    check(file.encrypt(output) == pesx::Error::InvalidSize, "encrypting an empty SaveFile", "none");
+}
+
+static void testKey(const MasterKeyInfo &masterKey, std::mt19937 &random)
+{
+    std::vector<std::uint8_t> encryptionHeader = randomBytes(random, ENCRYPTION_HEADER_SIZE);
+    std::vector<std::uint8_t> fileHeader       = randomBytes(random, masterKey.fileHeaderSize);
+    std::vector<std::uint8_t> description      = randomBytes(random, 2049);
+    std::vector<std::uint8_t> logo             = randomBytes(random, 4099);
+    std::vector<std::uint8_t> data             = randomBytes(random, 65537);
+    std::vector<std::uint8_t> serial           = randomBytes(random, 502);
+    std::memcpy(&fileHeader[offsetof(FileHeader, fileTypeString)], "EDIT\0\0\0", 8);
+
+    pesx::SaveFile created;
+    if (pesx::SaveFile::create(masterKey, encryptionHeader, fileHeader, description, logo, data, serial, created) != pesx::Error::None) {
+        check(false, "SaveFile::create", masterKey.name);
+        return;
+    }
+    const pesx::SaveFile &file = created;
+    check(file.fileType() == "EDIT" && equal(file.encryptionHeader(), encryptionHeader)
+          && equal(file.description(), description) && equal(file.logo(), logo)
+          && equal(file.data(), data) && equal(file.serial(), serial), "SaveFile::create", masterKey.name);
+
+    std::vector<std::uint8_t> encrypted(file.size());
+    check(file.encrypt(encrypted) == pesx::Error::None, "SaveFile::encrypt", masterKey.name);
+
+    // The encrypted file must be readable by the C functions.
+    FileDescriptor *descriptor = createFileDescriptor();
+    check(decryptWithKeyInfoChecked(descriptor, encrypted.data(), static_cast<std::uint32_t>(encrypted.size()), &masterKey, 0) == CRYPT_OK
+          && !std::memcmp(descriptor->encryptionHeader, encryptionHeader.data(), ENCRYPTION_HEADER_SIZE)
+          && !std::memcmp(descriptor->data, data.data(), data.size()), "decryptWithKeyInfoChecked", masterKey.name);
+    destroyFileDescriptor(descriptor);
+
+    pesx::SaveFile decrypted;
+    check(pesx::SaveFile::decrypt(encrypted, masterKey, decrypted) == pesx::Error::None
+          && equal(decrypted.bytes(), file.bytes()), "SaveFile::decrypt of a span", masterKey.name);
+
+    auto buffer = std::make_unique<std::uint8_t[]>(encrypted.size());
+    std::memcpy(buffer.get(), encrypted.data(), encrypted.size());
+    pesx::SaveFile inPlace;
+    check(pesx::SaveFile::decrypt(buffer, encrypted.size(), masterKey, inPlace) == pesx::Error::None
+          && !buffer && equal(inPlace.bytes(), file.bytes()), "SaveFile::decrypt in place", masterKey.name);
+
+    // A failed decryption leaves the buffer to the caller, unchanged.
+    buffer = std::make_unique<std::uint8_t[]>(encrypted.size());
+    std::memcpy(buffer.get(), encrypted.data(), encrypted.size());
+    pesx::SaveFile truncated;
+    check(pesx::SaveFile::decrypt(buffer, encrypted.size() - 1, masterKey, truncated) == pesx::Error::InvalidSize
+          && buffer && !std::memcmp(buffer.get(), encrypted.data(), encrypted.size()) && truncated.empty(),
+          "SaveFile::decrypt of a truncated file", masterKey.name);
+
+    // Edit a block in place and encrypt again with a cache.
+    KeystreamCache *cache = createKeystreamCache(2*file.size());
+    inPlace.data()[0] ^= 0xFF;
+    std::vector<std::uint8_t> reencrypted(inPlace.size());
+    check(inPlace.encrypt(reencrypted, cache) == pesx::Error::None
+          && pesx::SaveFile::decrypt(reencrypted, masterKey, decrypted) == pesx::Error::None
+          && decrypted.data()[0] == (data[0] ^ 0xFF) && equal(decrypted.logo(), logo), "SaveFile::encrypt after an edit", masterKey.name);
+    destroyKeystreamCache(cache);
+
+    // Block sizes changed through the file header that no longer fit the buffer leave all blocks empty.
+    FileHeader header = inPlace.header();
+    header.dataSize += 1;
+    std::memcpy(inPlace.fileHeader().data(), &header, masterKey.fileHeaderSize);
+    check(inPlace.description().empty() && inPlace.logo().empty() && inPlace.data().empty() && inPlace.serial().empty()
+          && inPlace.encrypt(reencrypted) == pesx::Error::InvalidSize, "SaveFile with block sizes that do not fit", masterKey.name);
+    header.dataSize -= 1;
+    std::memcpy(inPlace.fileHeader().data(), &header, masterKey.fileHeaderSize);
+    check(inPlace.data().size() == data.size(), "SaveFile with restored block sizes", masterKey.name);
+}
+
+int main()
+{
+    testEmpty();
+
+    std::mt19937 random(2016);
+    for (int i = 0; i < getMasterKeyCount(); ++i)
+        testKey(*getMasterKeyInfo(i), random);
+
+    if (failures)
+        std::printf("%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}